@@ -1,5 +1,8 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <math.h>
 
 #define PB1 1
 #define PB4 4
@@ -8,29 +11,96 @@
 #define PD1 1
 
 
-uint8_t dc_table[] = {5, 20, 36, 51, 66, 82, 97, 112, 128, 143, 158, 174, 189, 204, 220, 235, 250};
-	            // %: 2   8  14  20  26  32  38  44   50   56   62   68   74   80   86   92   98
+// the eye sees brightness roughly as duty^(1/2.2), so equal steps in
+// duty cycle look uneven, most of them at the dark end
+// gamma_table maps 65 evenly looking levels to 10-bit duty cycles:
+// duty = 1023 * (level/64)^2.2, worked out by the compiler (no float at run time)
+// the curve rounds levels 1 and 2 to 0 as well, so at the dark end every
+// level gets at least its own number of counts: 0, 1, 2 ... 6, then the curve
+#define PWM_TOP 1023
+#define LEVELS 64
+#define GAMMA_CURVE(i) ((uint16_t)(PWM_TOP * pow((i) / (double)LEVELS, 2.2) + 0.5))
+#define GAMMA(i) (GAMMA_CURVE(i) > (i) ? GAMMA_CURVE(i) : (i))
+#define GAMMA4(i) GAMMA(i), GAMMA(i+1), GAMMA(i+2), GAMMA(i+3)
+#define GAMMA16(i) GAMMA4(i), GAMMA4(i+4), GAMMA4(i+8), GAMMA4(i+12)
+
+const uint16_t gamma_table[LEVELS + 1] PROGMEM = {
+	GAMMA16(0), GAMMA16(16), GAMMA16(32), GAMMA16(48), GAMMA(64)
+};
+
+// the buttons move 4 levels at a time, 17 steps like the old dc_table
 #define dc_values 17
+#define LEVELS_PER_STEP (LEVELS / (dc_values - 1))
+
+// TIMER1_OVF moves the output one level towards target_level
+// every FADE_DIVIDER overflows: 15.6KHz / 64 = 244 levels per second
+#define FADE_DIVIDER 64
+
+volatile uint8_t level = 0;
+volatile uint8_t target_level = 0;
+
+// mode 2 runs entirely in ADC_vect: every Timer1 overflow starts a
+// conversion and the result goes through an exponential moving average
+// (y += (x - y) / 8, kept scaled by 8) and the gamma table into OCR1A
+#define EMA_SHIFT 3
+volatile uint16_t pot_ema = 0;
+
+ISR(ADC_vect){
+	pot_ema += ADC - (pot_ema >> EMA_SHIFT);
+	
+	// 10-bit filtered value to a level (0-64, * 65 / 1024 so the knob
+	// reaches the top of the table too) and straight to the output,
+	// keep the fade idle so TIMER1_OVF doesn't pull it back
+	uint8_t pot_level = ((uint32_t)(pot_ema >> EMA_SHIFT) * (LEVELS + 1)) >> 10;
+	level = pot_level;
+	target_level = pot_level;
+	OCR1A = pgm_read_word(&gamma_table[pot_level]);
+}
+
+void pot_control_start(){
+	// auto trigger on Timer1 overflow (ADTS=110), a conversion takes
+	// 13.5 ADC clocks (108us) so every other overflow starts one: ~7.8KHz
+	ADCSRB = (1 << ADTS2) | (1 << ADTS1);
+	ADCSRA |= (1 << ADATE) | (1 << ADIE);
+}
+
+void pot_control_stop(){
+	ADCSRA &= ~((1 << ADATE) | (1 << ADIE));
+}
+
+ISR(TIMER1_OVF_vect){
+	static uint8_t ticks = 0;
+	if (++ticks < FADE_DIVIDER) return;
+	ticks = 0;
+	
+	if (level == target_level) return;
+	if (level < target_level) level++;
+	else level--;
+	
+	// OCR1A is double buffered, the new value applies from the next period
+	OCR1A = pgm_read_word(&gamma_table[level]);
+}
 
 int main(){
 	
-	// set TMR1A in fast 8 bit mode with non-inverted output 
+	// set TMR1A in fast 10 bit mode with non-inverted output 
 	
-	// fpwm = fclk / N(1+255) where N is the prescaler
-	// to achieve fpwm = 62.500 we do:
-	// 62.500 = 16.000.000 / (N + 255) => N=1
+	// fpwm = fclk / N(1+1023) where N is the prescaler
+	// with N=1: fpwm = 16.000.000 / 1024 = 15.625KHz, still far too fast to see
 	// so the working frequency of the TCNT1 is clk/1 (CS10=1)
 	
-	TCCR1A = (1 << WGM10) | (1 << COM1A1);
+	TCCR1A = (1 << WGM11) | (1 << WGM10) | (1 << COM1A1);
 	TCCR1B = (1 << WGM12) | (1 << CS10);
+	TIMSK1 = (1 << TOIE1);     // overflow interrupt runs the fades
 	
-	// ADMUX[0-3]=0000 because the input is adc0, ADLAR=1 to left-adjust the ADC result 
+	// ADMUX[0-3]=0000 because the input is adc0, ADLAR=0 to keep all 10 bits for the filter
 	// REFSn[1:0]=01 to select Vref= 5V
 	
 	// ADEN=1 => ADC Enable
 	// ADPS[2:0]=111 => Fadc=16MHz/128=125KHz (i used the frequency of the example in theory)
+	// conversions are started by Timer1 in mode 2 (pot_control_start)
 	
-	ADMUX  = (1 << REFS0) | (1 << ADLAR);         
+	ADMUX  = (1 << REFS0);         
 	ADCSRA = (1 << ADEN) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); 
 
 	// Ι/Ο 
@@ -45,9 +115,10 @@ int main(){
 	
 	// for mode1
 	
-	uint8_t dc_index = 8;           // start at 50% (9th element)
-	OCR1A = dc_table[dc_index];
-	uint8_t DC_VALUE = dc_table[dc_index];
+	uint8_t dc_index = 8;           // start at half brightness (9th step)
+	target_level = dc_index * LEVELS_PER_STEP;
+	
+	sei();
 	
 	// for mode2
 	
@@ -58,11 +129,14 @@ int main(){
 	
 	--- how it works ---
 	
-	MODE1: The buttons increase or decrease the duty cycle and the brightness follows 
+	MODE1: The buttons increase or decrease the brightness level, the duty cycle comes from the gamma table 
+	       and TIMER1_OVF fades the led to the new level instead of jumping there
 	
 	MODE2: At first the potentiometer increases the amplitude of the analog signal (DC voltage).
 		   Then it passes this signal though the ADC, making it digital and puts the result om the OCR1A register that controls the duty cycle.
 		   As the amplitude increases the number inside OCR1A increases as well, giving higher duty cycle and as a result brighter light 
+		   (the ADC result picks a level of the gamma table, so the knob feels even across its range)
+		   The ADC is triggered by Timer1 and the interrupt does all of this, the main loop only watches the mode buttons
 	
 	*/
 
@@ -71,17 +145,18 @@ int main(){
 		// PD0 => mode 1
 		if (!(PIND & (1 << PD0))){
 			mode = 1;
+			pot_control_stop();
 			_delay_ms(80);
 
 			// reset brightness at 50% every time we switch modes
 			dc_index = 8;
-			DC_VALUE = dc_table[dc_index];
-			OCR1A = DC_VALUE;
+			target_level = dc_index * LEVELS_PER_STEP;
 		}
 
 		// PD1 => mode 2
-		if (!(PIND & (1 << PD1))){
+		if (!(PIND & (1 << PD1)) && mode != 2){
 			mode = 2;
+			pot_control_start();
 			_delay_ms(80);
 		}
 		
@@ -91,8 +166,7 @@ int main(){
 			if (!(PINB & (1 << PB4))){          
 				if (dc_index < dc_values - 1) {
 					dc_index++;
-					DC_VALUE = dc_table[dc_index];
-					OCR1A = DC_VALUE;
+					target_level = dc_index * LEVELS_PER_STEP;
 				}
 				while (!(PINB & (1 << PB4)));  // wait until release
 				_delay_ms(50);
@@ -101,22 +175,15 @@ int main(){
 			if (!(PINB & (1 << PB5))) {         
 				if (dc_index > 0) {
 					dc_index--;
-					DC_VALUE = dc_table[dc_index];
-					OCR1A = DC_VALUE;
+					target_level = dc_index * LEVELS_PER_STEP;
 				}
 				while (!(PINB & (1 << PB5)));  // wait until release
 				_delay_ms(50);
 			}
 		}
 		
-		// control with potentiometer
-		
-		else if (mode == 2) {
-			ADCSRA |= (1 << ADSC);          // start conversion           
-			while (ADCSRA & (1 << ADSC));   // wait until done
-			OCR1A = ADCH;                   // use the 8 higher bits for PWM's duty cycle   
-			_delay_ms(80);                       
-		}
+		// control with potentiometer: nothing to do here,
+		// ADC_vect updates the duty cycle on its own (see pot_control_start)
 	}
 }
 
@@ -0,0 +1,22 @@
+#ifndef _CO_CALIBRATION_
+#define _CO_CALIBRATION_
+
+// generated by tools/gen_co_table.py from tools/co_curve.csv, do not edit
+
+#include <avr/pgmspace.h>
+
+// (adc, ppm x10) breakpoints, sorted by adc
+#define CO_TABLE_SIZE 8
+
+const uint16_t co_table[CO_TABLE_SIZE][2] PROGMEM = {
+	{  20,     0},
+	{  21,     2},
+	{ 228,   786},
+	{ 319,  1130},
+	{ 537,  1955},
+	{ 740,  2724},
+	{ 831,  3068},
+	{1023,  3794}
+};
+
+#endif /*CO_CALIBRATION*/
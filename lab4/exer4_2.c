@@ -5,6 +5,10 @@
 #include <avr/cpufunc.h>	
 #include <stdio.h>
 
+// voltage in millivolts = adc * 5000 / 1024, as a Q16 factor
+// worked out by the compiler so no float code ends up in the program
+#define MILLIVOLT_SCALE ((uint32_t)(5000.0 / 1024.0 * 65536.0 + 0.5))
+
 void write_2_nibbles(uint8_t data){
 	
 	uint8_t temp;
@@ -103,11 +107,14 @@ int main(){
 	while (ADCSRA & (1 << ADSC));   // wait until done
 	
 	uint16_t adc_value = ADC;       // read the result (all 10 bits)
-	float voltage = (adc_value * 5.0) / 1024.0;  // get te volatge
+	// get the voltage in millivolts, +0.5 rounds to the nearest one
+	uint16_t millivolts = ((uint32_t)adc_value * MILLIVOLT_SCALE + 0x8000) >> 16;
 	
-	// lcd prints only ascii, so we convert the float "voltage" into char
+	// lcd prints only ascii, so we convert the voltage into char
+	// hundredths of a volt, rounded
+	uint16_t centivolts = (millivolts + 5) / 10;
 	char buffer[8];
-	snprintf(buffer, sizeof(buffer), "%.2f", voltage);
+	snprintf(buffer, sizeof(buffer), "%u.%02u", centivolts / 100, centivolts % 100);
 	
 	lcd_clear_display();
 
@@ -3,9 +3,13 @@
 #include <util/delay.h>
 #include <stdbool.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "co_calibration.h"
 
 volatile int adc;
 volatile bool newData = false;
+// set by the comparator when the CO level crosses the alarm threshold
+volatile bool co_crossed = false;
 
 void write_2_nibbles(uint8_t input){
 	
@@ -91,11 +95,87 @@ void lcd_init(){
 	lcd_command(0x06);
 }
 
+int16_t co_ppm(uint16_t adc_value){
+	// CO concentration in tenths of a ppm from the calibration table
+	// (tools/gen_co_table.py builds it from the sensor curve)
+	
+	// below or above the table, clamp to its ends
+	if (adc_value <= pgm_read_word(&co_table[0][0])) return pgm_read_word(&co_table[0][1]);
+	if (adc_value >= pgm_read_word(&co_table[CO_TABLE_SIZE-1][0])) return pgm_read_word(&co_table[CO_TABLE_SIZE-1][1]);
+	
+	// binary search for the segment with low <= adc < high,
+	// at most log2(CO_TABLE_SIZE) steps
+	uint8_t low = 0;
+	uint8_t high = CO_TABLE_SIZE - 1;
+	while (high - low > 1){
+		uint8_t mid = (low + high) / 2;
+		if (adc_value < pgm_read_word(&co_table[mid][0])) high = mid;
+		else low = mid;
+	}
+	
+	// interpolate on the straight line between the two breakpoints
+	uint16_t adc0 = pgm_read_word(&co_table[low][0]);
+	uint16_t adc1 = pgm_read_word(&co_table[high][0]);
+	int16_t ppm0 = pgm_read_word(&co_table[low][1]);
+	int16_t ppm1 = pgm_read_word(&co_table[high][1]);
+	
+	// rounded to the nearest tenth, not towards 0
+	// (gen_co_table.py checks the table against this same arithmetic)
+	int32_t num = (int32_t)(ppm1 - ppm0) * (adc_value - adc0);
+	uint16_t span = adc1 - adc0;
+	num += (num < 0) ? -(int32_t)(span / 2) : (int32_t)(span / 2);
+	return ppm0 + num / span;
+}
+
 ISR(ADC_vect){
 	adc = ADC;
 	newData = true;
 }
 
+ISR(ANALOG_COMP_vect){
+	// ACO=0: ADC3 went above the 1.1V bandgap (about 77 ppm, right
+	// where the 75 ppm alarm is), light the alarm leds right away
+	// and let the main loop take a precise reading
+	if (!(ACSR & (1<<ACO))) PORTB = 0b00000011;
+	co_crossed = true;
+}
+
+void comparator_watch(){
+	// between readings the analog comparator watches the sensor
+	// the ADC mux (ADC3) is the negative input, which only works
+	// with the ADC turned off, and the bandgap is the positive input
+	ADCSRA &= ~(1<<ADEN);
+	ADCSRB |= (1<<ACME);
+	
+	// change the inputs with the interrupt off, it can fire on the switch
+	ACSR = (1<<ACBG);
+	_delay_us(70);			// bandgap start up time
+	ACSR |= (1<<ACI);		// clear the flag of the switch
+	ACSR |= (1<<ACIE);		// interrupt on both edges (ACIS=00)
+}
+
+uint16_t co_read(){
+	// hand the mux back to the ADC for one conversion
+	ACSR &= ~(1<<ACIE);
+	ADCSRB &= ~(1<<ACME);
+	ADCSRA |= (1<<ADEN);
+	
+	newData = false;
+	ADCSRA |= (1<<ADSC);
+	while(!newData);
+	
+	comparator_watch();
+	return adc;
+}
+
+void co_delay(int delay){
+	// delay that ends early when the comparator sees a crossing
+	for (int i=0; i<delay; i++){
+		if (co_crossed) break;
+		_delay_ms(1);
+	}
+}
+
 int main(){
 	DDRD = 0xFF;
 	DDRC &= ~(1<<PD3);
@@ -107,55 +187,52 @@ int main(){
 	
 	lcd_init();
 	
-	float ppm = 0.0;
-	float voltage = 0.0;
+	int16_t ppm = 0;	// tenths of a ppm
 	
 	sei();
 	
+	comparator_watch();
+	
 	while(1){
-		newData = false;
-		ADCSRA |= (1<<ADSC);
-		while(!newData);
-		
-		voltage = (adc*5.0)/1024.0;
-		ppm = (voltage - 0.1) * 77.52;
+		co_crossed = false;
+		ppm = co_ppm(co_read());
 		
-		if (ppm < 75){
+		if (ppm < 750){
 			lcd_clear_display();
 			lcd_print_clear();
 				
-			if (ppm < 56.848){
+			if (ppm < 568){
 				PORTB = 0b00000001;			
-				_delay_ms(100);
+				co_delay(100);
 			}
 			else{
 				PORTB = 0b00000011;
-				_delay_ms(100);		
+				co_delay(100);		
 			}
 		}
 		else{
 			lcd_clear_display();
 			lcd_print_gas();
 			
-			if (ppm < 121.448){
+			if (ppm < 1214){
 				PORTB = 0b00000011;
 				_delay_ms(50);
 				PORTB = 0b00000000;
 				_delay_ms(50);	
 			}
-			else if (ppm < 186.048){
+			else if (ppm < 1860){
 				PORTB = 0b00000111;
 				_delay_ms(50);
 				PORTB = 0b00000000;
 				_delay_ms(50);				
 			}
-			else if (ppm < 250.648){
+			else if (ppm < 2506){
 				PORTB = 0b00001111;
 				_delay_ms(50);
 				PORTB = 0b00000000;
 				_delay_ms(50);
 			}			
-			else if (ppm < 315.248){
+			else if (ppm < 3152){
 				PORTB = 0b00011111;
 				_delay_ms(50);
 				PORTB = 0b00000000;
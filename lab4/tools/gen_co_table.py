@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Generate the CO sensor calibration table for exer4_3.c.
+
+Reads (voltage, ppm) points of the sensor curve from a CSV file and
+writes a header with a PROGMEM table of (adc, ppm x10) breakpoints.
+Breakpoints are picked from the curve so that co_ppm's integer
+interpolation between the rounded table entries stays within
+--tolerance of the curve.
+
+usage: gen_co_table.py [curve.csv] [-o ../co_calibration.h]
+"""
+
+import argparse
+import os
+
+VREF = 5.0          # AVcc reference
+ADC_STEPS = 1024    # 10-bit ADC
+MAX_POINTS = 32     # flash budget for the table
+
+
+def read_curve(path):
+    points = []
+    with open(path) as f:
+        for line in f:
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            volts, ppm = (float(x) for x in line.split(','))
+            points.append((volts, ppm))
+    points.sort()
+    return points
+
+
+def ppm_at(points, volts):
+    # linear interpolation on the curve itself
+    if volts <= points[0][0]:
+        return points[0][1]
+    for (v0, p0), (v1, p1) in zip(points, points[1:]):
+        if volts <= v1:
+            return p0 + (p1 - p0) * (volts - v0) / (v1 - v0)
+    return points[-1][1]
+
+
+def curve_in_adc(points):
+    # ppm x10 for every adc code between the first and last curve point
+    first = max(0, round(points[0][0] * ADC_STEPS / VREF))
+    last = min(ADC_STEPS - 1, round(points[-1][0] * ADC_STEPS / VREF))
+    return [(adc, ppm_at(points, adc * VREF / ADC_STEPS) * 10)
+            for adc in range(first, last + 1)]
+
+
+def co_ppm(a0, p0, a1, p1, adc):
+    # same arithmetic as co_ppm() in exer4_3.c: rounded division of
+    # integers, C division truncates towards 0
+    num = (p1 - p0) * (adc - a0)
+    span = a1 - a0
+    num += span // 2 if num >= 0 else -(span // 2)
+    quotient = abs(num) // span
+    return p0 + (quotient if num >= 0 else -quotient)
+
+
+def pick_breakpoints(samples, tolerance):
+    # greedy: extend each segment while every sample it covers stays
+    # within tolerance of what the firmware makes of the table, that
+    # is with the ppm of both ends rounded as they are written out
+    chosen = [samples[0]]
+    start = 0
+    while start < len(samples) - 1:
+        end = start + 1
+        while end + 1 < len(samples):
+            a0, p0 = samples[start]
+            a1, p1 = samples[end + 1]
+            p0, p1 = round(p0), round(p1)
+            if any(abs(co_ppm(a0, p0, a1, p1, a) - p) > tolerance
+                   for a, p in samples[start:end + 2]):
+                break
+            end += 1
+        chosen.append(samples[end])
+        start = end
+    return chosen
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('curve', nargs='?',
+                        default=os.path.join(here, 'co_curve.csv'))
+    parser.add_argument('-o', '--output',
+                        default=os.path.join(here, '..', 'co_calibration.h'))
+    parser.add_argument('--tolerance', type=float, default=1.0,
+                        help='max interpolation error in tenths of a ppm')
+    args = parser.parse_args()
+
+    samples = curve_in_adc(read_curve(args.curve))
+    table = pick_breakpoints(samples, args.tolerance)
+    if len(table) > MAX_POINTS:
+        raise SystemExit('%d breakpoints, more than %d: raise --tolerance'
+                         % (len(table), MAX_POINTS))
+
+    rows = ',\n'.join('\t{%4d, %5d}' % (adc, round(ppm)) for adc, ppm in table)
+    with open(args.output, 'w', newline='\n') as f:
+        f.write('''#ifndef _CO_CALIBRATION_
+#define _CO_CALIBRATION_
+
+// generated by tools/gen_co_table.py from tools/%s, do not edit
+
+#include <avr/pgmspace.h>
+
+// (adc, ppm x10) breakpoints, sorted by adc
+#define CO_TABLE_SIZE %d
+
+const uint16_t co_table[CO_TABLE_SIZE][2] PROGMEM = {
+%s
+};
+
+#endif /*CO_CALIBRATION*/
+''' % (os.path.basename(args.curve), len(table), rows))
+
+
+if __name__ == '__main__':
+    main()
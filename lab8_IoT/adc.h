@@ -2,16 +2,293 @@
 #define _ADC_
 
 #include "utils.h"
+#include "filter.h"
+#include "convert.h"
+#include <avr/sleep.h>
+#include <util/atomic.h>
 
-float read_pressure(){
-	// start conversion
+// analog inputs used across the labs
+#define ADC_PRESSURE 0		// ADC0, pressure sensor (lab 8)
+#define ADC_POT 1			// ADC1, potentiometer (lab 3)
+#define ADC_CO 3			// ADC3, CO sensor (lab 4)
+
+// sequencer limits, the buffer size must be a power of two
+#define ADC_SEQ_MAX_CHANNELS 4
+#define ADC_SEQ_BUFFER_SIZE 8
+// smoothing of the filtered value, alpha = 1/2^shift
+#define ADC_SEQ_EMA_SHIFT 3
+
+// one ring buffer per channel of the sequence
+typedef struct {
+	uint8_t channel;
+	volatile uint16_t buffer[ADC_SEQ_BUFFER_SIZE];
+	volatile uint16_t sum;		// running sum of the buffer
+	volatile uint8_t head;		// where the next sample goes
+	EMA_FILTER ema;				// filtered value, updated by the isr
+} ADC_SEQ_SLOT;
+
+ADC_SEQ_SLOT adc_seq[ADC_SEQ_MAX_CHANNELS];
+uint8_t adc_seq_length = 0;
+volatile uint8_t adc_seq_current = 0;
+// set when the sample in progress was taken right after a mux switch
+volatile bool adc_seq_discard = false;
+bool adc_seq_discard_first = false;
+
+// conversions are started by a timer instead of the isr
+typedef enum {
+	ADC_TRIGGER_NONE = 0,
+	ADC_TRIGGER_TIMER0 = 3,		// ADTS = 011, Timer0 compare match A
+	ADC_TRIGGER_TIMER1 = 5		// ADTS = 101, Timer1 compare match B
+} ADC_TRIGGER_SOURCE;
+
+volatile ADC_TRIGGER_SOURCE adc_trigger = ADC_TRIGGER_NONE;
+
+// at /128 an auto triggered conversion takes 13.5 ADC clocks
+#define ADC_MAX_RATE (F_CPU / 128 / 14)
+
+// returned by adc_read_quiet when the sequencer owns the ADC
+#define ADC_BUSY 0xFFFF
+
+// set by ADC_vect when a single quiet conversion is done
+volatile bool adc_quiet_done = false;
+
+void adc_select(uint8_t channel){
+	// keep the reference and alignment bits, change only MUX3:0
+	ADMUX = (ADMUX & 0xF0) | (channel & 0x0F);
+}
+
+ISR(ADC_vect){
+	// single conversion from adc_read_quiet, nothing else to do
+	if (adc_seq_length == 0){
+		adc_quiet_done = true;
+		return;
+	}
+
+	uint16_t sample = ADC;
+	ADC_SEQ_SLOT* slot = &adc_seq[adc_seq_current];
+
+	if (adc_seq_discard){
+		// the sample and hold had not settled on the new input
+		adc_seq_discard = false;
+	}
+	else{
+		// replace the oldest sample and keep the sum up to date
+		uint8_t head = slot->head;
+		slot->sum += sample - slot->buffer[head];
+		slot->buffer[head] = sample;
+		slot->head = (head + 1) & (ADC_SEQ_BUFFER_SIZE - 1);
+		ema_update(&slot->ema, sample);
+
+		// move on to the next channel of the list
+		if (adc_seq_length > 1){
+			if (++adc_seq_current >= adc_seq_length) adc_seq_current = 0;
+			adc_select(adc_seq[adc_seq_current].channel);
+			adc_seq_discard = adc_seq_discard_first;
+		}
+	}
+
+	// no isr clears the compare flag, and the ADC only
+	// triggers on its rising edge, so clear it here
+	if (adc_trigger == ADC_TRIGGER_TIMER1) TIFR1 = (1<<OCF1B);
+	else if (adc_trigger == ADC_TRIGGER_TIMER0) TIFR0 = (1<<OCF0A);
+	// without a trigger start the next conversion right away,
+	// the mux is only sampled when a conversion starts
+	// so the new channel applies to this one
+	else ADCSRA |= (1<<ADSC);
+}
+
+void adc_seq_init(const uint8_t* channels, uint8_t length, bool discard_first){
+	// channels: list of ADC inputs (0-7) sampled round robin from ADC_vect
+	// discard_first: throw away the first sample after every mux switch
+	if (length > ADC_SEQ_MAX_CHANNELS) length = ADC_SEQ_MAX_CHANNELS;
+
+	// stop any conversion before touching the state the isr uses
+	// (a timer trigger has to be set up again with adc_trigger_init)
+	ADCSRA &= ~((1<<ADIE)|(1<<ADATE));
+	while(ADCSRA & (1<<ADSC));
+	adc_trigger = ADC_TRIGGER_NONE;
+
+	for (int i=0; i<length; i++){
+		adc_seq[i].channel = channels[i];
+		for (int j=0; j<ADC_SEQ_BUFFER_SIZE; j++) adc_seq[i].buffer[j] = 0;
+		adc_seq[i].sum = 0;
+		adc_seq[i].head = 0;
+		ema_init(&adc_seq[i].ema, ADC_SEQ_EMA_SHIFT, 0);
+	}
+	adc_seq_length = length;
+	adc_seq_current = 0;
+	adc_seq_discard_first = discard_first;
+	adc_seq_discard = discard_first;
+
+	// AVcc reference, right adjusted, /128 prescaler (125KHz)
+	ADMUX = (1<<REFS0);
+	adc_select(channels[0]);
+	ADCSRA = (1<<ADEN)|(1<<ADIE)|(1<<ADPS0)|(1<<ADPS1)|(1<<ADPS2);
+
+	sei();
 	ADCSRA |= (1<<ADSC);
-	// wait for conversion to finish
+}
+
+bool adc_trigger_init(ADC_TRIGGER_SOURCE source, uint16_t rate_hz){
+	// start every conversion on a timer compare match, rate_hz
+	// conversions per second shared by all channels of the sequence
+	// Timer0 reaches down to 62Hz, Timer1 down to 1Hz
+	if (rate_hz == 0 || rate_hz > ADC_MAX_RATE) return 0;
+	// Timer0 is not ours while it runs the 1ms tick of timer.h,
+	// reprogramming or stopping it would freeze every deadline
+	if (source == ADC_TRIGGER_TIMER0 && (TIMSK0 & (1<<OCIE0A))) return 0;
+
+	// smallest prescaler that fits the period in the timer
+	const uint16_t prescalers[] = {1, 8, 64, 256, 1024};
+	uint32_t limit = (source == ADC_TRIGGER_TIMER0) ? 256 : 65536;
+	uint8_t cs = 0;
+	uint32_t top = 0;
+	for (int i=0; i<5; i++){
+		top = F_CPU / prescalers[i] / rate_hz;
+		if (top <= limit){
+			cs = i + 1;
+			break;
+		}
+	}
+	if (cs == 0) return 0;
+
+	adc_trigger = source;
+	if (source == ADC_TRIGGER_TIMER0){
+		// CTC, TOP = OCR0A
+		TCCR0A = (1<<WGM01);
+		TCCR0B = 0;
+		TCNT0 = 0;
+		OCR0A = top - 1;
+		TIFR0 = (1<<OCF0A);
+		TCCR0B = cs;
+	}
+	else{
+		// CTC, TOP = OCR1A, compare B on the same count
+		TCCR1A = 0;
+		TCCR1B = (1<<WGM12);
+		TCNT1 = 0;
+		OCR1A = top - 1;
+		OCR1B = top - 1;
+		TIFR1 = (1<<OCF1B);
+		TCCR1B = (1<<WGM12) | cs;
+	}
+
+	// auto trigger from the selected source
+	ADCSRB = (ADCSRB & ~0x07) | source;
+	ADCSRA |= (1<<ADATE);
+
+	return 1;
+}
+
+void adc_trigger_stop(){
+	ADCSRA &= ~(1<<ADATE);
+	if (adc_trigger == ADC_TRIGGER_TIMER0) TCCR0B = 0;
+	else if (adc_trigger == ADC_TRIGGER_TIMER1) TCCR1B = 0;
+	adc_trigger = ADC_TRIGGER_NONE;
+}
+
+void adc_seq_stop(){
+	adc_trigger_stop();
+	ADCSRA &= ~(1<<ADIE);
 	while(ADCSRA & (1<<ADSC));
-	// store adc measurement
-	uint16_t adc = ADCL | (ADCH<<8);
-	// return pressure
-	return (adc / 1023.0) * 20.0;
+	adc_seq_length = 0;
+}
+
+uint16_t adc_seq_latest(uint8_t slot){
+	// slot is the position of the channel in the list given to adc_seq_init
+	uint16_t sample;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		uint8_t last = (adc_seq[slot].head - 1) & (ADC_SEQ_BUFFER_SIZE - 1);
+		sample = adc_seq[slot].buffer[last];
+	}
+	return sample;
+}
+
+uint16_t adc_seq_average(uint8_t slot){
+	// mean of the last ADC_SEQ_BUFFER_SIZE samples
+	uint16_t sum;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		sum = adc_seq[slot].sum;
+	}
+	return sum / ADC_SEQ_BUFFER_SIZE;
+}
+
+uint16_t adc_seq_filtered(uint8_t slot){
+	// exponential moving average of every sample of the channel
+	uint16_t value;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		value = ema_value(&adc_seq[slot].ema);
+	}
+	return value;
+}
+
+uint16_t adc_read_quiet(uint8_t channel){
+	// one conversion in ADC Noise Reduction sleep: the cpu, the
+	// I/O clock and with them the TWI, timers 0/1 and USART are
+	// stopped while the ADC samples, so their switching noise is gone
+	// Timer0 only pauses for the ~104us of the conversion, millis()
+	// falls behind by that much each time
+	if (adc_seq_length > 0) return ADC_BUSY;
+
+	uint8_t sreg = SREG;
+	cli();
+
+	// AVcc reference, right adjusted
+	ADMUX = (1<<REFS0) | (channel & 0x0F);
+	// single conversion, clear any stale ADIF so the isr can't
+	// fire before our own conversion is done
+	ADCSRA = (1<<ADEN)|(1<<ADIE)|(1<<ADIF)|(1<<ADPS0)|(1<<ADPS1)|(1<<ADPS2);
+	adc_quiet_done = false;
+
+	// USART0 stops with the I/O clock too: a byte in UDR0 or still
+	// shifting out would be cut short and the receiver would miss
+	// whatever the ESP sends meanwhile, so while USART0 is in use
+	// only idle: less quiet, but the ADC still starts when the cpu
+	// sleeps (with the ESP link up that is every time)
+	bool usart_on = UCSR0B & ((1 << TXEN0) | (1 << RXEN0));
+	set_sleep_mode(usart_on ? SLEEP_MODE_IDLE : SLEEP_MODE_ADC);
+	sleep_enable();
+	while(!adc_quiet_done){
+		// entering the sleep mode starts the conversion
+		// sei only takes effect after the next instruction, so the
+		// ADC interrupt can't fire between the check and the sleep
+		// if another interrupt wakes us first the conversion keeps
+		// running and sleeping again does not restart it
+		sei();
+		sleep_cpu();
+		cli();
+	}
+	sleep_disable();
+
+	uint16_t sample = ADC;
+	SREG = sreg;
+	return sample;
+}
+
+uint8_t adc_seq_slot(uint8_t channel){
+	// position of a channel in the running sequence, 0xFF if not in it
+	for (int i=0; i<adc_seq_length; i++){
+		if (adc_seq[i].channel == channel) return i;
+	}
+	return 0xFF;
+}
+
+uint16_t read_pressure(){
+	// pressure in hundredths of a cmH2O
+	uint16_t adc;
+	uint8_t slot = adc_seq_slot(ADC_PRESSURE);
+
+	if (slot != 0xFF){
+		// the sequencer is sampling ADC0, use the average it keeps
+		adc = adc_seq_average(slot);
+	}
+	else{
+		// convert with the cpu asleep instead of spinning on ADSC
+		adc = adc_read_quiet(ADC_PRESSURE);
+		if (adc == ADC_BUSY) return 0;
+	}
+
+	return adc_to_centi_cmh2o(adc);
 }
 
 #endif /*ADC*/
\ No newline at end of file
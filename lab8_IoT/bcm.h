@@ -0,0 +1,98 @@
+#ifndef _BCM_
+#define _BCM_
+
+#include "utils.h"
+
+// 8-bit brightness for up to 6 leds on PB0-PB5 with binary code modulation
+// a period is split in 8 slices, slice k lasts 2^k time units and in it
+// every led shows bit k of its brightness, so the led is on for exactly
+// brightness/255 of the period with only 8 Timer2 interrupts per period
+
+// led n is PBn, the isr rewrites all of PB0..PB(BCM_LEDS-1)
+// PB3 and PB4 are TXD1/RXD1 of the 1-Wire bus in one_wire_usart.h,
+// with ONE_WIRE_USART1 only PB0-PB2 are left for leds
+#ifndef BCM_LEDS
+#ifdef ONE_WIRE_USART1
+#define BCM_LEDS 3
+#else
+#define BCM_LEDS 6
+#endif
+#endif
+#if defined(ONE_WIRE_USART1) && BCM_LEDS > 3
+#error "PB3/PB4 belong to the 1-Wire bus with ONE_WIRE_USART1, BCM_LEDS can be 3 at most"
+#endif
+#define BCM_MASK ((1 << BCM_LEDS) - 1)
+
+// Timer2 at clk/256 (16us per count), slice k lasts 2^(k+1) counts:
+// 32us up to 4.1ms, one period is 510 counts = 8.16ms (122Hz)
+// the isr sets the next TOP after the timer restarted, so it must run
+// within the shortest slice (512 cpu cycles), or TCNT2 is already past
+// TOP and the timer runs all the way to 255 (a visible flash)
+#define BCM_SLICE_TOP(k) ((2 << (k)) - 1)
+
+uint8_t bcm_brightness[BCM_LEDS];		// written by the application
+uint8_t bcm_slices[2][8];				// port value of every slice, per buffer
+volatile uint8_t bcm_front = 0;			// buffer the isr is showing
+volatile bool bcm_swap = false;			// back buffer ready, swap on next period
+volatile uint8_t bcm_bit = 0;
+
+ISR(TIMER2_COMPA_vect){
+	// the timer has just restarted from 0, set the length of the
+	// next slice first so the compare can't be missed
+	uint8_t bit = (bcm_bit + 1) & 7;
+	OCR2A = BCM_SLICE_TOP(bit);
+	bcm_bit = bit;
+
+	// only swap at the start of a period so the leds never
+	// show half an old and half a new pattern
+	if (bit == 0 && bcm_swap){
+		bcm_front ^= 1;
+		bcm_swap = false;
+	}
+
+	PORTB = (PORTB & ~BCM_MASK) | bcm_slices[bcm_front][bit];
+}
+
+void bcm_set(uint8_t led, uint8_t brightness){
+	// takes effect on bcm_update()
+	if (led < BCM_LEDS) bcm_brightness[led] = brightness;
+}
+
+void bcm_update(){
+	// wait until the isr took the previous update
+	while(bcm_swap);
+
+	// turn the brightness values into one port value per slice
+	uint8_t* back = bcm_slices[bcm_front ^ 1];
+	for (int k=0; k<8; k++){
+		uint8_t port = 0;
+		for (int led=0; led<BCM_LEDS; led++){
+			if (bcm_brightness[led] & (1 << k)) port |= (1 << led);
+		}
+		back[k] = port;
+	}
+
+	bcm_swap = true;
+}
+
+void bcm_init(){
+	DDRB |= BCM_MASK;
+
+	for (int led=0; led<BCM_LEDS; led++) bcm_brightness[led] = 0;
+	for (int k=0; k<8; k++){
+		bcm_slices[0][k] = 0;
+		bcm_slices[1][k] = 0;
+	}
+	bcm_bit = 0;
+
+	// Timer2 CTC, TOP = OCR2A, clk/256
+	TCCR2A = (1<<WGM21);
+	TCNT2 = 0;
+	OCR2A = BCM_SLICE_TOP(0);
+	TIMSK2 = (1<<OCIE2A);
+	TCCR2B = (1<<CS22)|(1<<CS21);
+
+	sei();
+}
+
+#endif /*BCM*/
\ No newline at end of file
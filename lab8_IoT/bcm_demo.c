@@ -0,0 +1,32 @@
+#include "utils.h"
+#include "bcm.h"
+
+// bcm.h on its own: a bright spot runs back and forth over the leds
+// on PORTB, the ones it left behind fade out slowly
+// build it instead of main.c, add -DONE_WIRE_USART1 to see the 3 led version
+
+#define STEP_MS 120			// time the spot stays on one led
+#define FADE_MS 15			// time between two fade steps
+
+int main(){
+	bcm_init();
+
+	int8_t led = 0;
+	int8_t direction = 1;
+	while(1){
+		bcm_set(led, 255);
+
+		for (int t=0; t<STEP_MS; t+=FADE_MS){
+			// every led but the spot loses a quarter of its brightness
+			for (int i=0; i<BCM_LEDS; i++){
+				if (i != led) bcm_brightness[i] = bcm_brightness[i] * 3 / 4;
+			}
+			bcm_update();
+			_delay_ms(FADE_MS);
+		}
+
+		// turn around at either end
+		if (led + direction < 0 || led + direction >= BCM_LEDS) direction = -direction;
+		led += direction;
+	}
+}
\ No newline at end of file
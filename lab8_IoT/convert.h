@@ -0,0 +1,58 @@
+#ifndef _CONVERT_
+#define _CONVERT_
+
+#include "utils.h"
+
+// sensor readings to integer physical units
+// every factor is written as the physical formula and turned into
+// a Q16 constant by the compiler, so at run time a conversion is
+// one 16x32 multiply and a shift, with no soft-float code
+
+#define Q16(x) ((uint32_t)((x) * 65536.0 + 0.5))
+
+// pressure: 0-1023 over 0-20 cmH2O, in hundredths of a cmH2O
+#define PRESSURE_SCALE Q16(20.0 * 100.0 / 1023.0)
+
+// voltage: 0-1023 over 0-5V (AVcc reference), in millivolts
+#define MILLIVOLT_SCALE Q16(5.0 * 1000.0 / 1024.0)
+
+// DS18B20: 1/16 C per bit, in hundredths of a C
+#define TEMP_SCALE Q16(100.0 / 16.0)
+
+uint16_t adc_to_centi_cmh2o(uint16_t adc){
+	// +0.5 in Q16 rounds to the nearest hundredth
+	return ((uint32_t)adc * PRESSURE_SCALE + 0x8000) >> 16;
+}
+
+uint16_t adc_to_millivolts(uint16_t adc){
+	return ((uint32_t)adc * MILLIVOLT_SCALE + 0x8000) >> 16;
+}
+
+int16_t raw_to_centi_celsius(int16_t raw){
+	// the sensor reads negative temperatures too, scale the magnitude
+	if (raw < 0) return -(int16_t)(((uint32_t)(-raw) * TEMP_SCALE + 0x8000) >> 16);
+	return ((uint32_t)raw * TEMP_SCALE + 0x8000) >> 16;
+}
+
+void fixed_format(char* buf, int16_t centi, uint8_t decimals){
+	// writes a value given in hundredths with 1 or 2 decimals,
+	// e.g. 3605 -> "36.05" or "36.1", buf needs 8 chars
+	uint16_t value;
+	if (centi < 0){
+		*buf++ = '-';
+		value = -centi;
+	}
+	else value = centi;
+
+	// drop the last digit, rounding to nearest
+	uint16_t divisor = 100;
+	if (decimals == 1){
+		value = (value + 5) / 10;
+		divisor = 10;
+	}
+
+	if (decimals == 1) sprintf(buf, "%u.%u", value / divisor, value % divisor);
+	else sprintf(buf, "%u.%02u", value / divisor, value % divisor);
+}
+
+#endif /*CONVERT*/
\ No newline at end of file
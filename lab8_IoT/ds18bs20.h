@@ -2,6 +2,36 @@
 #define _DS18BS20_
 
 #include "utils.h"
+#include <avr/pgmspace.h>
+
+// set to 0 to skip the CRC check and read only the temperature bytes
+#ifndef DS18B20_USE_CRC
+#define DS18B20_USE_CRC 1
+#endif
+
+// how many times a scratchpad read is repeated before giving up
+#define DS18B20_READ_RETRIES 3
+
+#define DS18B20_SCRATCHPAD_SIZE 9
+#define DS18B20_ERROR 0x8000
+
+// resolution is set by bits 6:5 of the configuration register
+// conversion time is 93.75ms at 9 bits and doubles with every extra bit
+typedef enum {
+	DS18B20_RES_9 = 0,		// 0.5 C, 93.75ms
+	DS18B20_RES_10 = 1,		// 0.25 C, 187.5ms
+	DS18B20_RES_11 = 2,		// 0.125 C, 375ms
+	DS18B20_RES_12 = 3		// 0.0625 C, 750ms (power-on default)
+} DS18B20_RESOLUTION;
+
+// resolution the device is currently set to
+DS18B20_RESOLUTION ds18b20_resolution = DS18B20_RES_12;
+
+// define ONE_WIRE_USART1 (e.g. -DONE_WIRE_USART1) to run the bus
+// from USART1 instead of bit-banging PD4
+#ifdef ONE_WIRE_USART1
+#include "one_wire_usart.h"
+#else
 
 #define clear(register, bit) (register &= ~(1 << bit))
 #define set(register, bit) (register |= (1 << bit))
@@ -73,31 +103,133 @@ void one_wire_transmit_byte(uint8_t byte){
 	}
 }
 
-int16_t read_temp(){
-	// check if a device is connected
-	if (!one_wire_reset()) return 0x8000;
-	// skip choosing a device
+#endif /*ONE_WIRE_USART1*/
+
+// Maxim CRC-8 (x^8 + x^5 + x^4 + 1, LSB first), one entry per nibble
+// crc_table[n] is what 4 shifts of the polynomial do to the low nibble n
+const uint8_t crc_table[16] PROGMEM = {
+	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
+	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
+};
+
+uint8_t crc8_update(uint8_t crc, uint8_t data){
+	crc ^= data;
+	crc = (crc >> 4) ^ pgm_read_byte(&crc_table[crc & 0x0F]);
+	crc = (crc >> 4) ^ pgm_read_byte(&crc_table[crc & 0x0F]);
+	return crc;
+}
+
+bool ds18b20_read_scratchpad(uint8_t* scratchpad){
+	// reset and skip device choosing
+	if (!one_wire_reset()) return 0;
 	one_wire_transmit_byte(0xCC);
 	
-	// start a conversion
-	one_wire_transmit_byte(0x44);
-	// wait for it to finish
-	while (!one_wire_receive_bit());
+	// read all 9 bytes, the crc is updated while the next one
+	// is still on its way so the check costs nothing at the end
+	one_wire_transmit_byte(0xBE);
+	uint8_t crc = 0;
+	for (int i=0; i<DS18B20_SCRATCHPAD_SIZE; i++){
+		scratchpad[i] = one_wire_receive_byte();
+		crc = crc8_update(crc, scratchpad[i]);
+	}
+	
+	// a shorted bus reads all zeros which also has a zero crc,
+	// but the low 5 bits of the configuration byte are always 1
+	if ((scratchpad[4] & 0x1F) != 0x1F) return 0;
+	
+	// the crc of the data followed by its own crc is always 0
+	return crc == 0;
+}
+
+uint16_t ds18b20_conversion_ms(DS18B20_RESOLUTION res){
+	// worst case conversion time rounded up: 94, 188, 375 or 750 ms
+	return (750 >> (3 - res)) + 1;
+}
+
+bool ds18b20_set_resolution(DS18B20_RESOLUTION res, bool save){
+	// read the alarm registers first, Write Scratchpad overwrites them too
+	uint8_t scratchpad[DS18B20_SCRATCHPAD_SIZE];
+	if (!ds18b20_read_scratchpad(scratchpad)) return 0;
 	
-	// reset again and skip device choosing
+	// write TH, TL and the configuration register
 	one_wire_reset();
 	one_wire_transmit_byte(0xCC);
+	one_wire_transmit_byte(0x4E);
+	one_wire_transmit_byte(scratchpad[2]);
+	one_wire_transmit_byte(scratchpad[3]);
+	one_wire_transmit_byte((res << 5) | 0x1F);
+	
+	// check that the device took the new configuration
+	if (!ds18b20_read_scratchpad(scratchpad)) return 0;
+	if ((scratchpad[4] >> 5) != res) return 0;
+	ds18b20_resolution = res;
+	
+	if (save){
+		// copy the scratchpad to eeprom so it survives a power cycle
+		one_wire_reset();
+		one_wire_transmit_byte(0xCC);
+		one_wire_transmit_byte(0x48);
+		// eeprom write takes up to 10ms
+		_delay_ms(10);
+	}
 	
-	// read the conversion
+	return 1;
+}
+
+int16_t ds18b20_read_fast(){
+	// reads the last conversion without starting a new one
+#if DS18B20_USE_CRC
+	uint8_t scratchpad[DS18B20_SCRATCHPAD_SIZE];
+	
+	for (int i=0; i<DS18B20_READ_RETRIES; i++){
+		if (ds18b20_read_scratchpad(scratchpad)){
+			int16_t temp = (scratchpad[1]<<8) | scratchpad[0];
+			// the bits below the selected resolution are undefined
+			return temp & ~((1 << (3 - ds18b20_resolution)) - 1);
+		}
+	}
+	
+	return DS18B20_ERROR;
+#else
+	if (!one_wire_reset()) return DS18B20_ERROR;
+	one_wire_transmit_byte(0xCC);
+	
+	// only the temperature is needed, stop after byte 2
+	// (the device aborts the read on the next reset)
 	one_wire_transmit_byte(0xBE);
 	uint8_t low = one_wire_receive_byte();
 	uint8_t high = one_wire_receive_byte();
+	one_wire_reset();
 	
-	int16_t temp_measured = 0;
-	temp_measured |= (high<<8);
-	temp_measured |= low;
+	int16_t temp = (high<<8) | low;
+	return temp & ~((1 << (3 - ds18b20_resolution)) - 1);
+#endif
+}
+
+bool ds18b20_start_conversion(){
+	// starts a conversion and returns at once, false if no device answered
+	// the result can be read with ds18b20_read_fast() after
+	// ds18b20_conversion_ms() of the current resolution
+	if (!one_wire_reset()) return 0;
+	// skip choosing a device
+	one_wire_transmit_byte(0xCC);
+	one_wire_transmit_byte(0x44);
+	return 1;
+}
+
+int16_t read_temp(){
+	// check if a device is connected and start a conversion
+	if (!ds18b20_start_conversion()) return DS18B20_ERROR;
+	// wait for it to finish, the device answers 1 when done
+	// each poll is one ~61us read slot, give up after the
+	// conversion time of the current resolution has passed twice
+	uint16_t polls = (uint32_t)ds18b20_conversion_ms(ds18b20_resolution) * 2000 / 61;
+	while (!one_wire_receive_bit()){
+		if (--polls == 0) return DS18B20_ERROR;
+	}
 	
-	return temp_measured;
+	// read the conversion
+	return ds18b20_read_fast();
 }
 
 #endif /*DS18BS20*/
\ No newline at end of file
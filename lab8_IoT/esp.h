@@ -0,0 +1,311 @@
+#ifndef _ESP_
+#define _ESP_
+
+#include "utils.h"
+#include "usart.h"
+#include "timer.h"
+#include "esp_link.h"
+#include "response.h"
+
+// ESP8266 client that never blocks: esp_poll() is called from the
+// main loop, sends the next command when the previous one is answered
+// and collects the answer from the USART receive buffer as it arrives
+
+#define ESP_ANSWER_SIZE 64
+#define ESP_TIMEOUT_MS 5000		// deadline of every command
+#define ESP_RETRIES 3			// tries per command before giving up
+#define ESP_BACKOFF_MS 2000		// wait before connecting again
+#define ESP_BUSY_MS 500			// wait before trying a command the ESP was too busy for
+
+#define ESP_URL "url:\"http://192.168.1.250:5000/data\""
+
+// speed asked from the ESP before connecting, the link starts at 9600
+// the ESP acks "baud:" at the old speed and switches, then the same
+// command is sent again at the new speed to confirm it: an ESP that
+// gets no confirmation within ESP_BAUD_REVERT_MS, or only garbage,
+// goes back to the slow speed on its own
+#define ESP_SLOW_BAUD 9600
+#define ESP_FAST_BAUD 115200
+#define ESP_BAUD_REVERT_MS 1000
+// a lost "baud:" ack must not let a command reach an ESP still at the fast speed
+#if ESP_TIMEOUT_MS <= ESP_BAUD_REVERT_MS
+#error "ESP_TIMEOUT_MS must be longer than ESP_BAUD_REVERT_MS"
+#endif
+#define ESP_STRING(x) #x
+#define ESP_BAUD_STRING(x) ESP_STRING(x)
+#define ESP_BAUD_COMMAND "baud:" ESP_BAUD_STRING(ESP_FAST_BAUD)
+
+// ask the ESP for binary payloads (see telemetry.h), 0 keeps json
+#ifndef ESP_BINARY_PAYLOAD
+#define ESP_BINARY_PAYLOAD 1
+#endif
+
+// then ask for the framed link (see esp_link.h), so reports no longer
+// wait for each answer before the next command goes out, 0 keeps
+// one command at a time (binary payloads are needed for it)
+#ifndef ESP_FRAMED_LINK
+#define ESP_FRAMED_LINK 1
+#endif
+
+// the commands in the order they are sent, numbered like on the lcd
+typedef enum {
+	ESP_BAUD = '0',
+	ESP_CONNECT = '1',
+	ESP_SET_URL = '2',
+	ESP_PAYLOAD = '3',
+	ESP_TRANSMIT = '4',
+	ESP_FORMAT = 'F',
+	ESP_FRAMING = 'L',
+	ESP_IDLE = 0			// connected, waiting for a report
+} ESP_STEP;
+
+ESP_STEP esp_step = ESP_BAUD;
+bool esp_fast = false;				// both sides switched to ESP_FAST_BAUD
+bool esp_binary = false;			// the ESP accepted binary payloads
+bool esp_framed = false;			// the ESP accepted the framed link
+bool esp_waiting = false;			// command sent, answer not complete yet
+uint32_t esp_deadline = 0;			// answer timeout, or end of the backoff
+uint8_t esp_tries = 0;
+bool esp_success = false;			// result of the last finished command
+
+char esp_answer[ESP_ANSWER_SIZE];
+LINE_ASSEMBLER esp_line;
+ESP_RESPONSE esp_response;			// what the answer said, parsed as it arrives
+
+// sends the payload command, set by the application
+void (*esp_payload_writer)(void) = 0;
+// the binary payload for the framed link instead, returns its length
+// (at most LINK_FRAME_MAX), set by the application to use the framed link
+uint8_t (*esp_payload_encoder)(uint8_t* payload) = 0;
+// told whether the report reached the server (optional)
+void (*esp_report_done)(bool sent) = 0;
+
+void esp_next_step(ESP_STEP next){
+	esp_step = next;
+	esp_tries = 0;
+	esp_waiting = false;
+	// the new command goes out straight away
+	esp_deadline = millis();
+}
+
+void esp_send_step(){
+	// a late answer to an earlier command (or the rest of one) would
+	// be taken for the answer to this one, start from an empty buffer
+	usart_rx_discard();
+	line_init(&esp_line, esp_answer, ESP_ANSWER_SIZE);
+	response_init(&esp_response);
+	esp_tries++;
+
+	switch(esp_step){
+		case ESP_BAUD:
+			// don't ask for a speed this clock can't make, the
+			// ESP would switch and be left waiting there
+			if (!esp_fast && !usart_baud_supported(ESP_FAST_BAUD)){
+				esp_next_step(ESP_CONNECT);
+				return;
+			}
+			esp_send_command(ESP_BAUD_COMMAND);
+			break;
+		case ESP_CONNECT: esp_send_command("connect"); break;
+		case ESP_SET_URL: esp_send_command(ESP_URL); break;
+		case ESP_FORMAT: esp_send_command("format:binary"); break;
+		case ESP_FRAMING: esp_send_command("framing:on"); break;
+		case ESP_PAYLOAD: esp_payload_writer(); break;
+		case ESP_TRANSMIT: esp_send_command("transmit"); break;
+		default: return;
+	}
+
+	esp_waiting = true;
+	esp_deadline = millis() + ESP_TIMEOUT_MS;
+}
+
+void esp_negotiate_baud(){
+	// each of the two "baud:" commands gets one try
+	if (!esp_fast){
+		if (esp_success && usart_set_baud(ESP_FAST_BAUD)){
+			// confirm at the new speed straight away
+			esp_fast = true;
+			esp_tries = 0;
+			esp_waiting = false;
+			esp_deadline = millis();
+			return;
+		}
+		// refused, or no ack: if only the ack got lost the ESP has
+		// already gone back, the timeout is longer than its wait
+		esp_next_step(ESP_CONNECT);
+		return;
+	}
+	
+	if (esp_success){
+		esp_next_step(ESP_CONNECT);
+		return;
+	}
+	
+	// no confirmation: go back to the slow speed and stay quiet
+	// until the ESP has given up on the fast one too
+	usart_set_baud(ESP_SLOW_BAUD);
+	esp_fast = false;
+	esp_next_step(ESP_CONNECT);
+	esp_deadline = millis() + ESP_BAUD_REVERT_MS;
+}
+
+void esp_link_down(){
+	// every report in flight is lost, the queue still has their readings
+	for (int i=0; i<LINK_WINDOW; i++){
+		if (link_frames[i].used && link_frames[i].tag == ESP_TRANSMIT && esp_report_done) esp_report_done(false);
+	}
+	link_reset();
+
+	// connect again as after any failure, the ESP takes plain
+	// commands at any time and answers them the same way
+	esp_framed = false;
+	esp_next_step(ESP_CONNECT);
+	esp_deadline = millis() + ESP_BACKOFF_MS;
+}
+
+bool esp_delivered(){
+	// transmit answers with whatever the server replied, anything but
+	// a refusal or no answer at all means the report got there
+	return esp_response.status == ESP_STATUS_SUCCESS || esp_response.status == ESP_STATUS_UNKNOWN;
+}
+
+ESP_STEP esp_link_poll(){
+	// esp_poll() of the framed link, payloads and transmits are
+	// answered in the order they were sent
+	uint8_t tag;
+	LINK_EVENT event = link_poll(esp_answer, ESP_ANSWER_SIZE, &tag);
+	if (event == LINK_NONE) return 0;
+
+	// the answer came in one frame, parse it all at once
+	response_init(&esp_response);
+	if (event == LINK_ANSWER) response_update(&esp_response, esp_answer, strlen(esp_answer));
+	response_finish(&esp_response, event == LINK_ANSWER);
+	esp_success = esp_response.status == ESP_STATUS_SUCCESS;
+
+	if (tag == ESP_TRANSMIT && esp_delivered()){
+		if (esp_report_done) esp_report_done(true);
+		return tag;
+	}
+	if (tag == ESP_PAYLOAD && esp_success) return tag;
+
+	// link_poll() already let go of a frame that was answered, so
+	// esp_link_down() won't find a refused transmit among those in flight
+	if (tag == ESP_TRANSMIT && event == LINK_ANSWER && esp_report_done) esp_report_done(false);
+
+	// a frame that never got through, or a refused payload or transmit
+	// whose followers the ESP may have already run:
+	// drop everything in flight and send it again after reconnecting
+	esp_link_down();
+	return tag;
+}
+
+ESP_STEP esp_poll(){
+	// returns the command that was just answered (or failed for good),
+	// its result is in esp_success and esp_answer, 0 when nothing happened
+	if (esp_step == ESP_IDLE) return esp_framed ? esp_link_poll() : 0;
+
+	if (!esp_waiting){
+		// send the command once any backoff is over
+		if (timer_expired(esp_deadline)) esp_send_step();
+		return 0;
+	}
+
+	// classify the answer as it arrives, a finished line is
+	// already terminated and the assembler starts over
+	LINE_RESULT result = line_poll(&esp_line);
+	if (result == LINE_PENDING){
+		response_update(&esp_response, esp_answer, esp_line.length);
+		if (!timer_expired(esp_deadline)) return 0;
+		esp_answer[esp_line.length] = '\0';
+		// drop what did arrive, part of the answer can't be trusted
+		usart_rx_discard();
+		result = LINE_TIMEOUT;
+	}
+	else response_update(&esp_response, esp_answer, strlen(esp_answer));
+	// a cut short answer still says how the command went
+	response_finish(&esp_response, result != LINE_TIMEOUT);
+
+	ESP_STEP finished = esp_step;
+	esp_success = esp_response.status == ESP_STATUS_SUCCESS;
+	
+	if (esp_step == ESP_BAUD){
+		esp_negotiate_baud();
+		return finished;
+	}
+	
+	if (esp_step == ESP_FORMAT){
+		// an ESP that doesn't know the command keeps getting json
+		esp_binary = esp_success;
+		bool framing = ESP_FRAMED_LINK && esp_binary && esp_payload_encoder;
+		esp_next_step(framing ? ESP_FRAMING : ESP_IDLE);
+		return finished;
+	}
+
+	if (esp_step == ESP_FRAMING){
+		// same for the framed link, the numbering starts from 0 on both sides
+		esp_framed = esp_success;
+		link_reset();
+		esp_next_step(ESP_IDLE);
+		return finished;
+	}
+
+	if (esp_success || (esp_step == ESP_TRANSMIT && esp_delivered())){
+		switch(esp_step){
+			case ESP_CONNECT: esp_next_step(ESP_SET_URL); break;
+			case ESP_SET_URL: esp_next_step(ESP_BINARY_PAYLOAD ? ESP_FORMAT : ESP_IDLE); break;
+			case ESP_PAYLOAD: esp_next_step(ESP_TRANSMIT); break;
+			case ESP_TRANSMIT:
+				if (esp_report_done) esp_report_done(true);
+				esp_next_step(ESP_IDLE);
+				break;
+			default: esp_next_step(ESP_IDLE); break;
+		}
+		return finished;
+	}
+
+	esp_waiting = false;
+	if (esp_tries < ESP_RETRIES){
+		// try the same command again, a busy ESP gets a moment first
+		esp_deadline = millis();
+		if (esp_response.status == ESP_STATUS_BUSY) esp_deadline += ESP_BUSY_MS;
+	}
+	else{
+		// the report didn't make it, the application still has it
+		if (esp_step == ESP_PAYLOAD || esp_step == ESP_TRANSMIT){
+			if (esp_report_done) esp_report_done(false);
+		}
+		// assume the link is down and connect again,
+		// but give the ESP a break
+		esp_next_step(ESP_CONNECT);
+		esp_deadline = millis() + ESP_BACKOFF_MS;
+	}
+
+	return finished;
+}
+
+bool esp_ready(){
+	// the framed link takes another report while one is in flight
+	if (esp_framed) return esp_step == ESP_IDLE && link_free() >= 2;
+	return esp_step == ESP_IDLE;
+}
+
+bool esp_link_report(){
+	// payload and transmit go out back to back, a frame carries
+	// the command as it is sent without one, less the newline
+	uint8_t payload[LINK_FRAME_MAX];
+	uint8_t length = esp_payload_encoder(payload);
+	link_send(payload, length, ESP_PAYLOAD);
+	link_send((const uint8_t*)"ESP:transmit", 12, ESP_TRANSMIT);
+	return true;
+}
+
+bool esp_report(){
+	// starts payload + transmit, false if the link is busy or not connected
+	if (!esp_ready()) return false;
+	if (esp_framed) return esp_link_report();
+	if (esp_payload_writer == 0) return false;
+	esp_next_step(ESP_PAYLOAD);
+	return true;
+}
+
+#endif /*ESP*/
\ No newline at end of file
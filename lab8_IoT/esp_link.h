@@ -0,0 +1,219 @@
+#ifndef _ESP_LINK_
+#define _ESP_LINK_
+
+#include "utils.h"
+#include "usart.h"
+#include "timer.h"
+#include <util/crc16.h>
+
+// framed link to the ESP with a sliding window: up to LINK_WINDOW
+// commands are sent without waiting, each one is answered on its own
+// and only the ones that got lost or damaged are sent again
+//
+// a frame, both ways:
+//   0x16, sequence number, length, length bytes, crc low, crc high
+// the crc is CRC-16/CCITT (_crc_ccitt_update, starting at 0xFFFF) of
+// the sequence number, the length and the data
+// the ESP runs the frames in sequence order and answers each one with
+// a frame of the same number: 'A' and the answer text once it ran it,
+// or 'N' alone when it wants it again (damaged, or a gap before it)
+
+#define LINK_SYNC 0x16
+#define LINK_ACK 'A'
+#define LINK_NACK 'N'
+
+#define LINK_WINDOW 4				// frames in flight, a power of two
+#define LINK_FRAME_MAX 40			// longest data of a frame
+#define LINK_TIMEOUT_MS 5000		// resend a frame not answered by then
+#define LINK_RETRIES 3				// sends per frame before giving up
+
+typedef enum {
+	LINK_NONE = 0,			// nothing happened
+	LINK_ANSWER,			// a frame was answered, the text is in the answer buffer
+	LINK_FAILED				// a frame was sent LINK_RETRIES times without an answer
+} LINK_EVENT;
+
+typedef struct {
+	bool used;				// sent and not answered yet
+	uint8_t seq;
+	uint8_t tag;			// what the frame was, given by the caller
+	uint8_t tries;
+	uint32_t deadline;
+	uint8_t length;
+	uint8_t data[LINK_FRAME_MAX];
+} LINK_FRAME;
+
+// the frames in flight, frame n is in slot n & (LINK_WINDOW-1)
+LINK_FRAME link_frames[LINK_WINDOW];
+uint8_t link_base = 0;			// oldest frame not answered yet
+uint8_t link_next = 0;			// number of the next new frame
+
+// answer frame being received
+typedef enum {
+	LINK_RX_SYNC = 0,
+	LINK_RX_SEQ,
+	LINK_RX_LENGTH,
+	LINK_RX_DATA,
+	LINK_RX_CRC_LOW,
+	LINK_RX_CRC_HIGH
+} LINK_RX_STATE;
+
+LINK_RX_STATE link_rx_state = LINK_RX_SYNC;
+uint8_t link_rx_seq;
+uint8_t link_rx_length;
+uint8_t link_rx_count;
+uint16_t link_rx_crc;
+uint8_t link_rx_data[LINK_FRAME_MAX];
+
+void link_reset(){
+	// forget everything in flight, numbering starts again from 0
+	for (int i=0; i<LINK_WINDOW; i++) link_frames[i].used = false;
+	link_base = link_next = 0;
+	link_rx_state = LINK_RX_SYNC;
+}
+
+uint8_t link_free(){
+	// frames that can be sent right now
+	return LINK_WINDOW - (uint8_t)(link_next - link_base);
+}
+
+void link_transmit(LINK_FRAME* frame){
+	uint16_t crc = 0xFFFF;
+	crc = _crc_ccitt_update(crc, frame->seq);
+	crc = _crc_ccitt_update(crc, frame->length);
+
+	usart_transmit(LINK_SYNC);
+	usart_transmit(frame->seq);
+	usart_transmit(frame->length);
+	for (int i=0; i<frame->length; i++){
+		crc = _crc_ccitt_update(crc, frame->data[i]);
+		usart_transmit(frame->data[i]);
+	}
+	usart_transmit(crc & 0xFF);
+	usart_transmit(crc >> 8);
+
+	frame->tries++;
+	frame->deadline = millis() + LINK_TIMEOUT_MS;
+}
+
+bool link_send(const uint8_t* data, uint8_t length, uint8_t tag){
+	// queues a frame and sends it at once, false if the window is full
+	if (link_free() == 0 || length > LINK_FRAME_MAX) return 0;
+
+	LINK_FRAME* frame = &link_frames[link_next & (LINK_WINDOW - 1)];
+	frame->used = true;
+	frame->seq = link_next++;
+	frame->tag = tag;
+	frame->tries = 0;
+	frame->length = length;
+	memcpy(frame->data, data, length);
+
+	link_transmit(frame);
+	return 1;
+}
+
+LINK_FRAME* link_in_flight(uint8_t seq){
+	// the frame with this number if it is still waiting for its answer
+	if ((uint8_t)(seq - link_base) >= (uint8_t)(link_next - link_base)) return 0;
+	LINK_FRAME* frame = &link_frames[seq & (LINK_WINDOW - 1)];
+	return frame->used ? frame : 0;
+}
+
+bool link_receive(){
+	// feeds received bytes to the frame parser, true when an
+	// answer frame with a good crc is in link_rx_*
+	uint8_t c;
+	while(usart_read(&c, 1)){
+		switch(link_rx_state){
+			case LINK_RX_SYNC:
+				// anything between frames is thrown away
+				if (c == LINK_SYNC){
+					link_rx_crc = 0xFFFF;
+					link_rx_state = LINK_RX_SEQ;
+				}
+				continue;
+			case LINK_RX_SEQ:
+				link_rx_seq = c;
+				link_rx_state = LINK_RX_LENGTH;
+				break;
+			case LINK_RX_LENGTH:
+				if (c == 0 || c > LINK_FRAME_MAX){
+					link_rx_state = LINK_RX_SYNC;
+					continue;
+				}
+				link_rx_length = c;
+				link_rx_count = 0;
+				link_rx_state = LINK_RX_DATA;
+				break;
+			case LINK_RX_DATA:
+				link_rx_data[link_rx_count++] = c;
+				if (link_rx_count == link_rx_length) link_rx_state = LINK_RX_CRC_LOW;
+				break;
+			case LINK_RX_CRC_LOW:
+				link_rx_crc ^= c;
+				link_rx_state = LINK_RX_CRC_HIGH;
+				continue;
+			case LINK_RX_CRC_HIGH:
+				link_rx_state = LINK_RX_SYNC;
+				if ((link_rx_crc ^ ((uint16_t)c << 8)) == 0) return 1;
+				// a damaged answer: send the frame again without waiting for
+				// the timeout, the ESP answers a frame it already ran again
+				// without running it twice (if the number is the damaged
+				// part the timeout still catches it)
+				LINK_FRAME* frame = link_in_flight(link_rx_seq);
+				if (frame && frame->tries < LINK_RETRIES) link_transmit(frame);
+				continue;
+		}
+		link_rx_crc = _crc_ccitt_update(link_rx_crc, c);
+	}
+	return 0;
+}
+
+LINK_EVENT link_poll(char* answer, uint8_t size, uint8_t* tag){
+	// never waits: handles what was received and resends what timed out
+	// on LINK_ANSWER and LINK_FAILED tag tells which frame it was
+	while(link_receive()){
+		LINK_FRAME* frame = link_in_flight(link_rx_seq);
+		// late answer to a frame that was already answered
+		if (frame == 0) continue;
+
+		if (link_rx_data[0] == LINK_NACK){
+			// only this one goes again, not the ones after it
+			if (frame->tries < LINK_RETRIES) link_transmit(frame);
+			continue;
+		}
+		if (link_rx_data[0] != LINK_ACK) continue;
+
+		uint8_t length = link_rx_length - 1;
+		if (length > size - 1) length = size - 1;
+		memcpy(answer, &link_rx_data[1], length);
+		answer[length] = '\0';
+
+		// the ESP answers in order, so a frame before this one that was
+		// last sent before it has lost its answer: ask for it again now
+		for (uint8_t seq = link_base; seq != frame->seq; seq++){
+			LINK_FRAME* earlier = link_in_flight(seq);
+			if (earlier == 0 || earlier->tries >= LINK_RETRIES) continue;
+			if ((int32_t)(frame->deadline - earlier->deadline) >= 0) link_transmit(earlier);
+		}
+
+		// slide the window over every answered frame at its start
+		frame->used = false;
+		*tag = frame->tag;
+		while(link_base != link_next && !link_frames[link_base & (LINK_WINDOW - 1)].used) link_base++;
+		return LINK_ANSWER;
+	}
+
+	for (int i=0; i<LINK_WINDOW; i++){
+		LINK_FRAME* frame = &link_frames[i];
+		if (!frame->used || !timer_expired(frame->deadline)) continue;
+		if (frame->tries >= LINK_RETRIES){
+			*tag = frame->tag;
+			return LINK_FAILED;
+		}
+		link_transmit(frame);
+	}
+	return LINK_NONE;
+}
+
+#endif /*ESP_LINK*/
\ No newline at end of file
@@ -0,0 +1,137 @@
+#ifndef _FILTER_
+#define _FILTER_
+
+#include "utils.h"
+
+// integer filters for ADC samples (0-1023)
+// every update is a fixed number of operations so they can
+// run inside ADC_vect
+
+// ---------------- exponential moving average ----------------
+// y += (x - y) / 2^shift, the state keeps y scaled by 2^shift
+// so no fraction is lost, shift up to 6 keeps 10-bit data in 16 bits
+
+typedef struct {
+	uint16_t acc;
+	uint8_t shift;
+} EMA_FILTER;
+
+void ema_init(EMA_FILTER* f, uint8_t shift, uint16_t initial){
+	f->shift = shift;
+	f->acc = initial << shift;
+}
+
+uint16_t ema_update(EMA_FILTER* f, uint16_t sample){
+	f->acc += sample - (f->acc >> f->shift);
+	return f->acc >> f->shift;
+}
+
+uint16_t ema_value(EMA_FILTER* f){
+	return f->acc >> f->shift;
+}
+
+// ---------------- boxcar (moving average) ----------------
+// sum of the last 2^shift samples, updated by adding the new
+// sample and subtracting the one that falls out of the window
+
+#define BOXCAR_MAX_TAPS 16
+
+typedef struct {
+	uint16_t samples[BOXCAR_MAX_TAPS];
+	uint16_t sum;
+	uint8_t oldest;
+	uint8_t shift;
+} BOXCAR_FILTER;
+
+void boxcar_init(BOXCAR_FILTER* f, uint8_t shift){
+	// 2^shift taps, at most BOXCAR_MAX_TAPS
+	f->shift = shift;
+	f->sum = 0;
+	f->oldest = 0;
+	for (int i=0; i<BOXCAR_MAX_TAPS; i++) f->samples[i] = 0;
+}
+
+uint16_t boxcar_update(BOXCAR_FILTER* f, uint16_t sample){
+	f->sum += sample - f->samples[f->oldest];
+	f->samples[f->oldest] = sample;
+	f->oldest = (f->oldest + 1) & ((1 << f->shift) - 1);
+	return f->sum >> f->shift;
+}
+
+// ---------------- median ----------------
+// keeps the last 3 or 5 samples, a single spike never reaches the output
+
+#define swap_if_greater(a, b) if ((a) > (b)) { uint16_t t = (a); (a) = (b); (b) = t; }
+
+typedef struct {
+	uint16_t samples[5];
+	uint8_t oldest;
+	uint8_t taps;		// 3 or 5
+} MEDIAN_FILTER;
+
+uint16_t median3(uint16_t a, uint16_t b, uint16_t c){
+	swap_if_greater(a, b);
+	swap_if_greater(b, c);
+	swap_if_greater(a, b);
+	return b;
+}
+
+uint16_t median5(uint16_t a, uint16_t b, uint16_t c, uint16_t d, uint16_t e){
+	// 7 exchanges are enough to place the middle element
+	swap_if_greater(a, b);
+	swap_if_greater(d, e);
+	swap_if_greater(a, d);
+	swap_if_greater(b, e);
+	swap_if_greater(b, c);
+	swap_if_greater(c, d);
+	swap_if_greater(b, c);
+	return c;
+}
+
+void median_init(MEDIAN_FILTER* f, uint8_t taps, uint16_t initial){
+	f->taps = (taps == 5) ? 5 : 3;
+	f->oldest = 0;
+	for (int i=0; i<5; i++) f->samples[i] = initial;
+}
+
+uint16_t median_update(MEDIAN_FILTER* f, uint16_t sample){
+	uint16_t* s = f->samples;
+	s[f->oldest] = sample;
+	if (++f->oldest >= f->taps) f->oldest = 0;
+
+	if (f->taps == 3) return median3(s[0], s[1], s[2]);
+	return median5(s[0], s[1], s[2], s[3], s[4]);
+}
+
+// ---------------- oversample and decimate ----------------
+// every extra bit of resolution needs 4 times the samples:
+// sum 4^bits samples and shift the sum right by bits
+// (needs some noise on the input to work, the ADC has plenty)
+
+typedef struct {
+	uint16_t sum;
+	uint8_t count;
+	uint8_t bits;		// extra bits, 2 turns 10-bit data into 12-bit
+	uint16_t value;		// last decimated output
+} DECIMATOR;
+
+void decimator_init(DECIMATOR* f, uint8_t bits){
+	// 4^bits 10-bit samples must fit in 16 bits, so bits <= 3
+	f->bits = bits;
+	f->sum = 0;
+	f->count = 0;
+	f->value = 0;
+}
+
+bool decimator_update(DECIMATOR* f, uint16_t sample){
+	// returns true when a new output is ready in f->value
+	f->sum += sample;
+	if (++f->count < (1 << (2 * f->bits))) return false;
+
+	f->value = f->sum >> f->bits;
+	f->sum = 0;
+	f->count = 0;
+	return true;
+}
+
+#endif /*FILTER*/
\ No newline at end of file
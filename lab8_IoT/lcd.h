@@ -3,6 +3,7 @@
 
 #include "utils.h"
 #include "pca9555.h"
+#include <avr/pgmspace.h>
 
 extern volatile uint8_t state;
 
@@ -55,6 +56,12 @@ void lcd_data(uint8_t data){
 	_delay_us(250);
 }
 
+void lcd_print_P(const char* string){
+	// a string kept in flash with PSTR() or PROGMEM
+	char c;
+	while((c = pgm_read_byte(string++)) != '\0') lcd_data(c);
+}
+
 void lcd_clear_display(){
 	lcd_command(1);
 	_delay_ms(5);
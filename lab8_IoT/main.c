@@ -5,6 +5,13 @@
 #include "adc.h"
 #include "ds18bs20.h"
 #include "keypad.h"
+#include "convert.h"
+#include "timer.h"
+#include "esp.h"
+#include "payload.h"
+#include "telemetry.h"
+#include "report.h"
+#include "scheduler.h"
 
 // state variable for lcd functions
 volatile uint8_t state = 0;
@@ -13,64 +20,90 @@ volatile uint8_t state = 0;
 // is cleared when nurse resolves (#)
 volatile bool nurse_call = false;
 
+// how often the patient report is refreshed and sent
+#define REPORT_PERIOD_MS 3000
+// how long an ESP answer stays on the lcd
+#define MESSAGE_MS 1500
+#define KEYPAD_PERIOD_MS 20
+// how often new readings are checked and due reports sent
+#define TELEMETRY_PERIOD_MS 100
+
+// scheduler slots, the lower one runs first when several are due
+#define TASK_ESP 0				// every tick, answers don't wait in the buffer
+#define TASK_KEYPAD 1
+#define TASK_TELEMETRY 2
+#define TASK_SAMPLE 3
+#define TASK_TEMPERATURE 4		// one shot, reads the conversion the sample started
+#define TASK_DISPLAY 5
+#define TASK_MESSAGE_END 6		// one shot, back to the report after an answer
+
+// latest measurements, in hundredths
+int16_t patient_temp = 0;
+uint16_t patient_press = 0;
+
+// an ESP answer is on the lcd instead of the report
+bool message_shown = false;
+
 void initialization();
-void patient_friendly_delay(int delay);
+void esp_task();
+void telemetry_task();
+void display_task();
+void message_end_task();
 void nurse_call_status();
-const char* patient_status(float temp, float press);
-void display_patient_measurements(float temp, float pressure);
-void patient_report(float temp, float press);
-void send_payload(float temp, float press);
+void take_measurements();
+void read_temperature();
+void queue_reading();
+void show_esp_answer(ESP_STEP step);
+const char* patient_status(int16_t temp, uint16_t press);
+void display_patient_measurements(int16_t temp, uint16_t pressure);
+void patient_report(int16_t temp, uint16_t press);
 
 int main(){
 	initialization();
-	// answer will receive ESP's answers
-	char answer[64];
-	
-	// connect to ESP
-	esp_send_command("connect");
-	esp_receive_answer(answer);
-	esp_print_response('1', answer);
-	_delay_ms(2000);
-	lcd_clear_display();
 	
-	// send url to ESP
-	esp_send_command("url:\"http://192.168.1.250:5000/data\"");
-	esp_receive_answer(answer);
-	esp_print_response('2', answer);
-	_delay_ms(2000);
-	lcd_clear_display();
+	// the first readings are in once the first conversion is done
+	uint16_t first = ds18b20_conversion_ms(ds18b20_resolution) + 10;
+	
+	// everything runs as a task from here on, the ESP client connects,
+	// sets the url and sends the reports in between the others
+	sched_add(TASK_ESP, esp_task, 1, 0);
+	sched_add(TASK_KEYPAD, nurse_call_status, KEYPAD_PERIOD_MS, 0);
+	sched_add(TASK_TELEMETRY, telemetry_task, TELEMETRY_PERIOD_MS, first);
+	sched_add(TASK_SAMPLE, take_measurements, REPORT_PERIOD_MS, 0);
+	sched_add(TASK_DISPLAY, display_task, REPORT_PERIOD_MS, first);
+	sched_run();
+}
+
+void esp_task(){
+	// show every ESP answer for a while, then go back to the report
+	ESP_STEP answered = esp_poll();
+	if (!answered) return;
+	
+	show_esp_answer(answered);
+	message_shown = true;
+	sched_once(TASK_MESSAGE_END, message_end_task, MESSAGE_MS);
+}
+
+void telemetry_task(){
+	// readings only go out when they changed enough,
+	// a status change (e.g. a nurse call) goes out at once
+	queue_reading();
 	
-	// start displaying patient status
-	while(1){
-		// take temperature
-		float real_temp = read_temp() * 0.0625;
-		float patient_temp = real_temp + 12.0;
-		// take pressure
-		float patient_press = read_pressure();
-
-		// display patient report
-		patient_report(patient_temp, patient_press);
-		patient_friendly_delay(3000);
-	
-		// send payload
-		send_payload(patient_temp, patient_press);	// calls esp_send_command() at the end
-		esp_receive_answer(answer);
-		esp_print_response('3', answer);
-		patient_friendly_delay(1500);
-		
-		// transmit
-		esp_send_command("transmit");
-		esp_receive_answer(answer);
-		lcd_data('4');
-		lcd_data('.');
-		for(int i=0; answer[i]!='\0'; i++){
-			if(answer[i] == '\r') continue;
-			lcd_data(answer[i]);
-		}
-		patient_friendly_delay(1500);
-	}
+	// send payload and transmit once a batch is due and the link is free
+	if (esp_ready() && telemetry_due()) esp_report();
 }
 
+void display_task(){
+	// an ESP answer keeps the lcd until its time is up
+	if (message_shown) return;
+	lcd_clear_display();
+	patient_report(patient_temp, patient_press);
+}
+
+void message_end_task(){
+	message_shown = false;
+	display_task();
+}
 
 void initialization(){
 	twi_init();
@@ -78,32 +111,70 @@ void initialization(){
 	PCA9555_0_write(REG_CONFIGURATION_1, 0b11110000);
 	
 	one_wire_reset();
+	// 0.25 C steps are plenty for the patient report and convert 4 times faster
+	ds18b20_set_resolution(DS18B20_RES_10, false);
 	
 	lcd_init();
 	
 	usart_init(UBRR);
 	
-	ADMUX = (1<<REFS0)|(0<<MUX0);
-	ADCSRA = (1<<ADEN)|(1<<ADPS0)|(1<<ADPS1)|(1<<ADPS2);
+	timer_init();
+	esp_payload_writer = telemetry_write;
+	esp_payload_encoder = telemetry_encode;
+	esp_report_done = telemetry_report_done;
+	
+	// sample the pressure sensor in the background
+	const uint8_t adc_channels[] = {ADC_PRESSURE};
+	adc_seq_init(adc_channels, 1, false);
+	// one sample every 1ms regardless of what the main loop does
+	adc_trigger_init(ADC_TRIGGER_TIMER1, 1000);
 	
 	lcd_clear_display();	// preserving mental health
 	
 	return;
 }
 
-void patient_friendly_delay(int delay){
-	// delay that allows for the keypad to be pressed
-	// during payload or transmit parts
-	
-	int iter = delay / 10;
-	for(int i=0; i<iter; i++){
-		_delay_ms(10);
-		nurse_call_status();
+void take_measurements(){
+	// start a temperature conversion and read it once it is done,
+	// the other tasks keep running in the meantime
+	if (ds18b20_start_conversion()){
+		sched_once(TASK_TEMPERATURE, read_temperature, ds18b20_conversion_ms(ds18b20_resolution));
 	}
-	
-	// this delay is always called after printing
-	// clear lcd here for a more readable main
+	// take pressure, temperatures and pressures are kept in hundredths
+	patient_press = read_pressure();
+}
+
+void read_temperature(){
+	// last temperature that passed the crc check
+	static int16_t raw_temp = 0;
+	
+	// keep the previous one if the read failed
+	int16_t new_temp = ds18b20_read_fast();
+	if (new_temp != (int16_t)DS18B20_ERROR) raw_temp = new_temp;
+	patient_temp = raw_to_centi_celsius(raw_temp) + 1200;
+}
+
+void queue_reading(){
+	const char* status = patient_status(patient_temp, patient_press);
+	REPORT_DECISION decision = report_check(patient_temp, patient_press, status);
+	if (decision == REPORT_SKIP) return;
+	
+	// a reading the full queue couldn't take doesn't count as sent,
+	// the next one is checked against the last one that got in
+	if (!telemetry_push(patient_temp, patient_press, status)) return;
+	report_taken(patient_temp, patient_press, status);
+	if (decision == REPORT_URGENT) telemetry_flush();
+}
+
+void show_esp_answer(ESP_STEP step){
 	lcd_clear_display();
+	esp_print_response(step, &esp_response);
+	
+	// transmit also shows what the server said after its status code
+	if (step != ESP_TRANSMIT || esp_response.status == ESP_STATUS_TIMEOUT) return;
+	lcd_command(0xC0);
+	char* message = esp_answer + esp_response.message;
+	for(int i=0; message[i]!='\0' && i<16; i++) lcd_data(message[i]);
 }
 
 void nurse_call_status(){
@@ -123,18 +194,18 @@ void nurse_call_status(){
 	}	
 }
 
-const char* patient_status(float temp, float press){
+const char* patient_status(int16_t temp, uint16_t press){
 	// returns appropriate patient status
 	if (nurse_call) return "NURSE CALL";
-	if (press<4.0 || press>12.0) return "CHECK PRESSURE";
-	if (temp<34.0 || temp>37.0) return "CHECK TEMP";
+	if (press<400 || press>1200) return "CHECK PRESSURE";
+	if (temp<3400 || temp>3700) return "CHECK TEMP";
 	return "OK";
 }
 
-void display_patient_measurements(float temp, float pressure){
+void display_patient_measurements(int16_t temp, uint16_t pressure){
 	// print temperature
-	char temp_buf[7];
-	sprintf(temp_buf, "%.1f", temp);
+	char temp_buf[8];
+	fixed_format(temp_buf, temp, 1);
 	for(int i=0; temp_buf[i]; i++) lcd_data(temp_buf[i]);
 	lcd_data(0b11011111);
 	lcd_data('C');
@@ -143,8 +214,8 @@ void display_patient_measurements(float temp, float pressure){
 	lcd_data(' ');
 	
 	// print pressure
-	char press_buf[7];
-	sprintf(press_buf, "%.1f", pressure);
+	char press_buf[8];
+	fixed_format(press_buf, pressure, 1);
 	for(int i=0; press_buf[i]; i++) lcd_data(press_buf[i]);
 	lcd_data('c');
 	lcd_data('m');
@@ -153,7 +224,7 @@ void display_patient_measurements(float temp, float pressure){
 	lcd_data('O');
 }
 
-void patient_report(float temp, float press){
+void patient_report(int16_t temp, uint16_t press){
 	// update patient status
 	nurse_call_status();
 	const char* status = patient_status(temp, press);
@@ -164,27 +235,4 @@ void patient_report(float temp, float press){
 	lcd_command(0xC0);
 	// display patient status
 	for(int i=0; status[i]!='\0'; i++) lcd_data(status[i]);
-}
-
-void send_payload(float patient_temp, float patient_press){
-	// payload params
-	const char* payload_status = patient_status(patient_temp, patient_press);
-	int payload_temp_integer = (int)patient_temp;
-	int payload_temp_decimal = (int)((patient_temp - payload_temp_integer) * 100);
-	int payload_press_integer = (int)patient_press;
-	int payload_press_decimal = (int)((patient_press - payload_press_integer) * 100);
-	
-	// build payload
-	char payload[256] = {0};
-	snprintf(payload, sizeof(payload),
-			"payload:[{\"name\":\"team\",\"value\":\"14\"},"
-			"{\"name\":\"temperature\",\"value\":\"%d.%d\"},"
-			"{\"name\":\"pressure\",\"value\":\"%d.%d\"},"
-			"{\"name\":\"status\",\"value\":\"%s\"}]",
-			payload_temp_integer, payload_temp_decimal,
-			payload_press_integer, payload_press_decimal,
-			payload_status);
-	
-	// send payload
-	esp_send_command(payload);
 }
\ No newline at end of file
@@ -0,0 +1,138 @@
+#ifndef _ONE_WIRE_USART_
+#define _ONE_WIRE_USART_
+
+#include "utils.h"
+#include <avr/sleep.h>
+
+// 1-Wire master on USART1 instead of bit-banging PD4
+// TXD1 (PB3) drives the bus through an open-drain buffer (or a diode
+// with the cathode on TXD1) and RXD1 (PB4) is connected to the bus,
+// so every bit that goes out is read back through the receiver
+// PB3 and PB4 can't be used for anything else then, bcm.h keeps
+// its leds to PB0-PB2 when ONE_WIRE_USART1 is defined
+
+// 9600 baud for the reset: 0xF0 holds the bus low for ~520us
+#define ONE_WIRE_UBRR_RESET ((F_CPU/16/9600)-1)
+// ~115200 baud (U2X) for the slots: one byte is one ~85us time slot
+#define ONE_WIRE_UBRR_SLOT ((F_CPU/8/115200)-1)
+
+// slot patterns, 0xFF writes a 1 or reads the bus, 0x00 writes a 0
+#define ONE_WIRE_SLOT_1 0xFF
+#define ONE_WIRE_SLOT_0 0x00
+
+volatile uint8_t one_wire_tx_byte;		// byte being sent, LSB first
+volatile uint8_t one_wire_rx_byte;		// bits read back so far
+volatile uint8_t one_wire_bits_left;	// slots still to go, 0 when idle
+
+ISR(USART1_RX_vect){
+	// every slot byte comes back through RXD1, bit 0 of the echo
+	// is the bus level at the sampling point of the slot
+	uint8_t echo = UDR1;
+	one_wire_rx_byte >>= 1;
+	if (echo == ONE_WIRE_SLOT_1) one_wire_rx_byte |= 0x80;
+
+	if (--one_wire_bits_left == 0) return;
+
+	// start the next slot
+	one_wire_tx_byte >>= 1;
+	UDR1 = (one_wire_tx_byte & 1) ? ONE_WIRE_SLOT_1 : ONE_WIRE_SLOT_0;
+}
+
+void one_wire_set_ubrr(unsigned int ubrr, bool double_speed){
+	// wait for anything still in the transmitter
+	while(!(UCSR1A & (1 << UDRE1)));
+	UCSR1A = double_speed ? (1 << U2X1) : 0;
+	UBRR1H = (unsigned char)(ubrr >> 8);
+	UBRR1L = (unsigned char)ubrr;
+}
+
+uint8_t one_wire_exchange(uint8_t slot){
+	// single slot without the interrupt, used for reset and single bits
+	UCSR1B &= ~(1 << RXCIE1);
+	UDR1 = slot;
+	while(!(UCSR1A & (1 << RXC1)));
+	uint8_t echo = UDR1;
+	UCSR1B |= (1 << RXCIE1);
+	return echo;
+}
+
+void one_wire_start_byte(uint8_t byte){
+	// the rest of the byte is sent from USART1_RX_vect
+	one_wire_tx_byte = byte;
+	one_wire_rx_byte = 0;
+	one_wire_bits_left = 8;
+	UDR1 = (byte & 1) ? ONE_WIRE_SLOT_1 : ONE_WIRE_SLOT_0;
+}
+
+bool one_wire_busy(){
+	return one_wire_bits_left != 0;
+}
+
+uint8_t one_wire_wait_byte(){
+	// the cpu idles between slots instead of spinning in _delay_us
+	// sei only takes effect after the next instruction, so the last
+	// slot can't end between the check and the sleep and leave us
+	// asleep until some other interrupt comes along
+	uint8_t sreg = SREG;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	cli();
+	while(one_wire_busy()){
+		sei();
+		sleep_cpu();
+		cli();
+	}
+	sleep_disable();
+	SREG = sreg;
+	return one_wire_rx_byte;
+}
+
+void one_wire_init(){
+	// PB3 output, PB4 input without pull-up (the bus has its own)
+	DDRB |= (1 << PB3);
+	DDRB &= ~(1 << PB4);
+	PORTB &= ~(1 << PB4);
+
+	one_wire_set_ubrr(ONE_WIRE_UBRR_SLOT, 1);
+	UCSR1B = (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
+	// 8 bits, no parity, 1 stop bit
+	UCSR1C = (3 << UCSZ10);
+
+	one_wire_bits_left = 0;
+	sei();
+}
+
+bool one_wire_reset(){
+	if (!(UCSR1B & (1 << TXEN1))) one_wire_init();
+
+	// a device pulls the bus low during the upper bits of 0xF0
+	one_wire_set_ubrr(ONE_WIRE_UBRR_RESET, 0);
+	uint8_t echo = one_wire_exchange(0xF0);
+	one_wire_set_ubrr(ONE_WIRE_UBRR_SLOT, 1);
+
+	// 0xF0 came back unchanged, nobody answered
+	if (echo == 0xF0) return 0;
+	return 1;
+}
+
+uint8_t one_wire_receive_bit(){
+	if (one_wire_exchange(ONE_WIRE_SLOT_1) == ONE_WIRE_SLOT_1) return 1;
+	return 0;
+}
+
+void one_wire_transmit_bit(bool output_bit){
+	one_wire_exchange(output_bit ? ONE_WIRE_SLOT_1 : ONE_WIRE_SLOT_0);
+}
+
+uint8_t one_wire_receive_byte(){
+	// reading is writing 1s and looking at what comes back
+	one_wire_start_byte(0xFF);
+	return one_wire_wait_byte();
+}
+
+void one_wire_transmit_byte(uint8_t byte){
+	one_wire_start_byte(byte);
+	one_wire_wait_byte();
+}
+
+#endif /*ONE_WIRE_USART*/
\ No newline at end of file
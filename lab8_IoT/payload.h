@@ -0,0 +1,90 @@
+#ifndef _PAYLOAD_
+#define _PAYLOAD_
+
+#include "utils.h"
+#include "usart.h"
+#include <avr/pgmspace.h>
+
+// writes the ESP payload command straight into the USART transmit
+// buffer one field at a time, no copy of the whole message is built:
+// ESP:payload:[{"name":"team","value":"14"},...]\n
+// names and the fixed json text are read from flash
+
+bool payload_first_field = true;
+
+void usart_print(const char* string){
+	for(int i=0; string[i]!='\0'; i++) usart_transmit(string[i]);
+}
+
+void usart_print_P(const char* string){
+	// same for a string kept in flash with PSTR()
+	char c;
+	while((c = pgm_read_byte(string++)) != '\0') usart_transmit(c);
+}
+
+void usart_print_uint(uint16_t value){
+	// digits come out lowest first, send them the other way round
+	char digits[5];
+	uint8_t count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while(value);
+	while(count) usart_transmit(digits[--count]);
+}
+
+void usart_print_fixed(int16_t centi){
+	// hundredths with both decimals, 3605 -> 36.05, 800 -> 8.00
+	uint16_t value;
+	if (centi < 0){
+		usart_transmit('-');
+		value = -centi;
+	}
+	else value = centi;
+
+	usart_print_uint(value / 100);
+	usart_transmit('.');
+	usart_transmit('0' + (value % 100) / 10);
+	usart_transmit('0' + value % 10);
+}
+
+void payload_begin(){
+	usart_print_P(PSTR("ESP:payload:["));
+	payload_first_field = true;
+}
+
+void payload_field_name(const char* name){
+	// {"name":"<name>","value":"   (the value follows)
+	if (!payload_first_field) usart_transmit(',');
+	payload_first_field = false;
+
+	usart_print_P(PSTR("{\"name\":\""));
+	usart_print_P(name);
+	usart_print_P(PSTR("\",\"value\":\""));
+}
+
+void payload_string_field(const char* name, const char* value){
+	// name is a PSTR(), value a string in ram
+	payload_field_name(name);
+	usart_print(value);
+	usart_print_P(PSTR("\"}"));
+}
+
+void payload_fixed_field(const char* name, int16_t centi){
+	// value in hundredths, sent with 2 decimals
+	payload_field_name(name);
+	usart_print_fixed(centi);
+	usart_print_P(PSTR("\"}"));
+}
+
+void payload_uint_field(const char* name, uint16_t value){
+	payload_field_name(name);
+	usart_print_uint(value);
+	usart_print_P(PSTR("\"}"));
+}
+
+void payload_end(){
+	usart_print_P(PSTR("]\n"));
+}
+
+#endif /*PAYLOAD*/
\ No newline at end of file
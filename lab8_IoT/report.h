@@ -0,0 +1,45 @@
+#ifndef _REPORT_
+#define _REPORT_
+
+#include "utils.h"
+#include "timer.h"
+#include <stdlib.h>
+
+// decides which readings are worth sending: a reading goes out when
+// it moved past a deadband since the last one sent, when nothing was
+// sent for a heartbeat interval, and always at once when the patient
+// status changes
+
+#define REPORT_TEMP_DEADBAND 10		// 0.1 C
+#define REPORT_PRESS_DEADBAND 20	// 0.2 cmH2O
+#define REPORT_HEARTBEAT_MS 60000	// longest silence
+
+typedef enum {
+	REPORT_SKIP = 0,		// nothing new
+	REPORT_SEND,			// send with the next batch
+	REPORT_URGENT			// status changed, send right away
+} REPORT_DECISION;
+
+// the last reading that was let through
+int16_t report_temp = 0;
+uint16_t report_press = 0;
+const char* report_status = 0;
+uint32_t report_time = 0;
+
+REPORT_DECISION report_check(int16_t temp, uint16_t press, const char* status){
+	if (report_status == 0 || strcmp(status, report_status) != 0) return REPORT_URGENT;
+	if (abs(temp - report_temp) >= REPORT_TEMP_DEADBAND) return REPORT_SEND;
+	if (abs((int16_t)(press - report_press)) >= REPORT_PRESS_DEADBAND) return REPORT_SEND;
+	if (timer_expired(report_time + REPORT_HEARTBEAT_MS)) return REPORT_SEND;
+	return REPORT_SKIP;
+}
+
+void report_taken(int16_t temp, uint16_t press, const char* status){
+	// deadbands are measured from here on
+	report_temp = temp;
+	report_press = press;
+	report_status = status;
+	report_time = millis();
+}
+
+#endif /*REPORT*/
\ No newline at end of file
@@ -0,0 +1,130 @@
+#ifndef _RESPONSE_
+#define _RESPONSE_
+
+#include "utils.h"
+#include "lcd.h"
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+
+// classifies the ESP's answers as they come in, one character at a
+// time, so nothing has to search the whole answer again afterwards:
+// the first keyword or server status code found decides the status,
+// e.g. "Success", "Fail", "ERROR", "busy p...", "200 OK", "503 ..."
+
+typedef enum {
+	ESP_STATUS_UNKNOWN = 0,		// an answer, but nothing recognised in it
+	ESP_STATUS_SUCCESS,
+	ESP_STATUS_FAIL,
+	ESP_STATUS_BUSY,			// try again a bit later
+	ESP_STATUS_TIMEOUT			// no complete answer in time
+} ESP_STATUS;
+
+// shown on the lcd, in the order of ESP_STATUS
+const char esp_status_unknown[] PROGMEM = "Unknown";
+const char esp_status_success[] PROGMEM = "Success";
+const char esp_status_fail[] PROGMEM = "Fail";
+const char esp_status_busy[] PROGMEM = "Busy";
+const char esp_status_timeout[] PROGMEM = "Timeout";
+const char* const esp_status_names[] PROGMEM = {
+	esp_status_unknown, esp_status_success, esp_status_fail,
+	esp_status_busy, esp_status_timeout
+};
+
+// words that give the status away, none of them starts with its own end
+const char esp_keyword_success[] PROGMEM = "Success";
+const char esp_keyword_fail[] PROGMEM = "Fail";
+const char esp_keyword_error[] PROGMEM = "ERROR";
+const char esp_keyword_busy[] PROGMEM = "busy";
+const char* const esp_keywords[] PROGMEM = {
+	esp_keyword_success, esp_keyword_fail, esp_keyword_error, esp_keyword_busy
+};
+const uint8_t esp_keyword_status[] PROGMEM = {
+	ESP_STATUS_SUCCESS, ESP_STATUS_FAIL, ESP_STATUS_FAIL, ESP_STATUS_BUSY
+};
+#define ESP_KEYWORDS 4
+
+typedef struct {
+	ESP_STATUS status;
+	uint16_t code;				// status code from the server (e.g. 200), 0 if none
+	uint8_t message;			// where the text after the code starts in the answer
+	uint8_t position;			// characters parsed so far
+	uint16_t number;			// number being read and its digits
+	uint8_t digits;
+	uint8_t matched[ESP_KEYWORDS];	// characters of each keyword matched so far
+} ESP_RESPONSE;
+
+void response_init(ESP_RESPONSE* r){
+	r->status = ESP_STATUS_UNKNOWN;
+	r->code = 0;
+	r->message = 0;
+	r->position = 0;
+	r->number = 0;
+	r->digits = 0;
+	for (int i=0; i<ESP_KEYWORDS; i++) r->matched[i] = 0;
+}
+
+void response_found(ESP_RESPONSE* r, ESP_STATUS status){
+	// only the first thing recognised counts
+	if (r->status == ESP_STATUS_UNKNOWN) r->status = status;
+}
+
+void response_end_number(ESP_RESPONSE* r, char next){
+	// a number of exactly 3 digits is taken as an http status code
+	if (r->digits == 3 && r->code == 0 && r->number >= 100 && r->number <= 599){
+		r->code = r->number;
+		r->message = r->position + (next == ' ');
+		if (r->code >= 200 && r->code <= 299) response_found(r, ESP_STATUS_SUCCESS);
+		else if (r->code == 429 || r->code == 503) response_found(r, ESP_STATUS_BUSY);
+		else if (r->code >= 400) response_found(r, ESP_STATUS_FAIL);
+	}
+	r->number = 0;
+	r->digits = 0;
+}
+
+void response_parse(ESP_RESPONSE* r, char c){
+	if (c >= '0' && c <= '9'){
+		if (r->digits < 4) r->number = r->number * 10 + (c - '0');
+		r->digits++;
+	}
+	else if (r->digits) response_end_number(r, c);
+
+	for (int i=0; i<ESP_KEYWORDS; i++){
+		const char* keyword = (const char*)pgm_read_word(&esp_keywords[i]);
+		// on a mismatch the character may still start the keyword again
+		if (pgm_read_byte(&keyword[r->matched[i]]) != c) r->matched[i] = 0;
+		if (pgm_read_byte(&keyword[r->matched[i]]) != c) continue;
+		if (pgm_read_byte(&keyword[++r->matched[i]]) == '\0'){
+			response_found(r, pgm_read_byte(&esp_keyword_status[i]));
+			r->matched[i] = 0;
+		}
+	}
+	r->position++;
+}
+
+void response_update(ESP_RESPONSE* r, const char* answer, uint8_t end){
+	// parses answer from where the last call stopped up to end,
+	// call it whenever more of the answer has arrived
+	while (r->position < end) response_parse(r, answer[r->position]);
+}
+
+void response_finish(ESP_RESPONSE* r, bool complete){
+	// the answer ended, or never came (complete false)
+	if (r->digits) response_end_number(r, '\0');
+	if (!complete) r->status = ESP_STATUS_TIMEOUT;
+}
+
+void esp_print_response(char step, ESP_RESPONSE* r){
+	// e.g. "1.Success" or "4.Success 200"
+	lcd_data(step);
+	lcd_data('.');
+	lcd_print_P((const char*)pgm_read_word(&esp_status_names[r->status]));
+
+	if (r->code){
+		char digits[6];
+		utoa(r->code, digits, 10);
+		lcd_data(' ');
+		for (int i=0; digits[i]!='\0'; i++) lcd_data(digits[i]);
+	}
+}
+
+#endif /*RESPONSE*/
\ No newline at end of file
@@ -0,0 +1,87 @@
+#ifndef _SCHEDULER_
+#define _SCHEDULER_
+
+#include "utils.h"
+#include "timer.h"
+#include <avr/sleep.h>
+
+// cooperative run to completion scheduler on the 1ms tick of timer.h
+// a task is a function that does a bit of work and returns, it runs
+// every period ms or once after a delay
+// the slot of a task is its priority, 0 first: when several are due
+// the lowest slot runs, then the list is checked again from the top
+// with nothing due the cpu sleeps until the next interrupt
+
+#define SCHED_MAX_TASKS 8
+
+typedef struct {
+	void (*run)(void);		// 0 for a free slot
+	uint32_t next;			// millis() when it is due
+	uint16_t period;		// 0 runs it once
+} SCHED_TASK;
+
+SCHED_TASK sched_tasks[SCHED_MAX_TASKS];
+
+bool sched_add(uint8_t priority, void (*run)(void), uint16_t period, uint16_t delay){
+	// run every period ms (0: only once), the first time after delay ms
+	if (priority >= SCHED_MAX_TASKS) return 0;
+	sched_tasks[priority].run = run;
+	sched_tasks[priority].period = period;
+	sched_tasks[priority].next = millis() + delay;
+	return 1;
+}
+
+bool sched_once(uint8_t priority, void (*run)(void), uint16_t delay){
+	// a one shot task, adding it again moves it to the new delay
+	return sched_add(priority, run, 0, delay);
+}
+
+void sched_wake(uint8_t priority){
+	// run a task on the next pass instead of waiting for its time
+	sched_tasks[priority].next = millis();
+}
+
+void sched_stop(uint8_t priority){
+	sched_tasks[priority].run = 0;
+}
+
+void sched_idle(){
+	// idle mode keeps the timers, the USART, the ADC and the TWI running,
+	// any of their interrupts (at least the 1ms tick) wakes the cpu
+	// a task that came due after the check waits one tick at most
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sleep_cpu();
+	sleep_disable();
+}
+
+bool sched_step(){
+	// runs the due task with the highest priority, false if none was due
+	for (int i=0; i<SCHED_MAX_TASKS; i++){
+		SCHED_TASK* task = &sched_tasks[i];
+		if (task->run == 0 || !timer_expired(task->next)) continue;
+
+		void (*run)(void) = task->run;
+		if (task->period == 0) task->run = 0;
+		else{
+			// keep the phase, but don't run it again and again
+			// to catch up after a long task held everything up
+			task->next += task->period;
+			if (timer_expired(task->next)) task->next = millis() + task->period;
+		}
+
+		// the task may add, move or stop tasks, itself too
+		run();
+		return 1;
+	}
+	return 0;
+}
+
+void sched_run(){
+	// the main loop, never returns
+	while(1){
+		if (!sched_step()) sched_idle();
+	}
+}
+
+#endif /*SCHEDULER*/
\ No newline at end of file
@@ -0,0 +1,209 @@
+#ifndef _TELEMETRY_
+#define _TELEMETRY_
+
+#include "utils.h"
+#include "payload.h"
+#include "timer.h"
+#include "esp.h"
+
+// store and forward queue of patient readings
+// readings wait in ram until a report gets through, so nothing is
+// lost while the link is down, and several of them share one
+// payload + transmit exchange
+
+#define TELEMETRY_QUEUE_SIZE 16		// readings kept, the oldest go first when full
+#define TELEMETRY_BATCH_SIZE 4		// most readings per payload
+// a partial batch is sent once its oldest reading is this old
+// 0 sends every reading as soon as the link is free and only batches
+// the backlog after an outage, more saves exchanges but delays readings
+#define TELEMETRY_FLUSH_MS 0
+
+// binary payload, about a tenth of the json one:
+// 0x02, length, then length bytes:
+//   schema version, team, number of readings,
+//   per reading: age in s (2), temperature (2), pressure (2), status (1)
+// multi-byte values are little endian, temperature and pressure in
+// hundredths, status is the index in telemetry_status_names
+// tools/decode_telemetry.py turns it back into the json payload
+#define TELEMETRY_FRAME_START 0x02
+#define TELEMETRY_SCHEMA 1
+#define TELEMETRY_TEAM 14
+
+const char* const telemetry_status_names[] = {
+	"OK", "NURSE CALL", "CHECK PRESSURE", "CHECK TEMP"
+};
+#define TELEMETRY_STATUSES 4
+
+// longest binary payload
+#define TELEMETRY_FRAME_SIZE (5 + 7 * TELEMETRY_BATCH_SIZE)
+
+// reports in flight at once, more than one only on the framed link
+// (every report takes a payload and a transmit frame)
+#define TELEMETRY_MAX_BATCHES (LINK_WINDOW / 2)
+
+typedef struct {
+	uint32_t time;			// millis() when taken
+	int16_t temp;			// hundredths of a C
+	uint16_t press;			// hundredths of a cmH2O
+	const char* status;
+} TELEMETRY_SAMPLE;
+
+TELEMETRY_SAMPLE telemetry_queue[TELEMETRY_QUEUE_SIZE];
+uint8_t telemetry_oldest = 0;
+uint8_t telemetry_count = 0;
+uint8_t telemetry_in_flight = 0;		// readings in the reports being sent
+uint8_t telemetry_batches[TELEMETRY_MAX_BATCHES];	// readings of each of them, oldest first
+uint8_t telemetry_batch_count = 0;
+bool telemetry_urgent = false;			// send without waiting for a batch
+
+bool telemetry_push(int16_t temp, uint16_t press, const char* status){
+	// false if the reading had to be dropped
+	if (telemetry_count == TELEMETRY_QUEUE_SIZE){
+		// full: the oldest reading makes room, but while a report is
+		// in flight it may be one of its readings, so the new one is
+		// dropped instead
+		if (telemetry_in_flight > 0) return 0;
+		telemetry_oldest = (telemetry_oldest + 1) % TELEMETRY_QUEUE_SIZE;
+		telemetry_count--;
+	}
+
+	TELEMETRY_SAMPLE* sample = &telemetry_queue[(telemetry_oldest + telemetry_count) % TELEMETRY_QUEUE_SIZE];
+	sample->time = millis();
+	sample->temp = temp;
+	sample->press = press;
+	sample->status = status;
+	telemetry_count++;
+	return 1;
+}
+
+bool telemetry_due(){
+	// a full batch is waiting, or the oldest reading has waited long enough
+	uint8_t waiting = telemetry_count - telemetry_in_flight;
+	if (waiting == 0 || telemetry_batch_count == TELEMETRY_MAX_BATCHES) return false;
+	if (telemetry_urgent || waiting >= TELEMETRY_BATCH_SIZE) return true;
+	uint8_t first = (telemetry_oldest + telemetry_in_flight) % TELEMETRY_QUEUE_SIZE;
+	return timer_expired(telemetry_queue[first].time + TELEMETRY_FLUSH_MS);
+}
+
+void telemetry_flush(){
+	// what is queued goes out as soon as the link is free
+	telemetry_urgent = true;
+}
+
+uint8_t telemetry_start_batch(uint8_t* size){
+	// the oldest readings not sent yet, up to a batch, become the next
+	// report: returns how far from the oldest reading they start
+	uint8_t first = telemetry_in_flight;
+	*size = 0;
+	// telemetry_due() keeps this from happening, an empty report at worst
+	if (telemetry_batch_count == TELEMETRY_MAX_BATCHES) return first;
+
+	*size = telemetry_count - first;
+	if (*size > TELEMETRY_BATCH_SIZE) *size = TELEMETRY_BATCH_SIZE;
+
+	telemetry_batches[telemetry_batch_count++] = *size;
+	telemetry_in_flight += *size;
+	return first;
+}
+
+void telemetry_write_batch(uint8_t first, uint8_t size){
+	// json payload of size readings from first on
+	// a single reading keeps the original layout, a batch adds
+	// the age of each reading in seconds in front of its fields
+	payload_begin();
+	payload_string_field(PSTR("team"), "14");
+	for (int i=0; i<size; i++){
+		TELEMETRY_SAMPLE* sample = &telemetry_queue[(telemetry_oldest + first + i) % TELEMETRY_QUEUE_SIZE];
+		if (size > 1) payload_uint_field(PSTR("age"), (millis() - sample->time) / 1000);
+		payload_fixed_field(PSTR("temperature"), sample->temp);
+		payload_fixed_field(PSTR("pressure"), sample->press);
+		payload_string_field(PSTR("status"), sample->status);
+	}
+	payload_end();
+}
+
+uint8_t telemetry_status_code(const char* status){
+	for (int i=0; i<TELEMETRY_STATUSES; i++){
+		if (strcmp(status, telemetry_status_names[i]) == 0) return i;
+	}
+	return 0xFF;
+}
+
+uint8_t* telemetry_put_word(uint8_t* p, uint16_t value){
+	*p++ = value & 0xFF;
+	*p++ = value >> 8;
+	return p;
+}
+
+uint8_t telemetry_encode_batch(uint8_t* frame, uint8_t first, uint8_t size){
+	// binary version of telemetry_write_batch into frame
+	// (TELEMETRY_FRAME_SIZE bytes), returns its length
+	uint8_t* p = frame;
+	*p++ = TELEMETRY_FRAME_START;
+	*p++ = 3 + 7 * size;
+	*p++ = TELEMETRY_SCHEMA;
+	*p++ = TELEMETRY_TEAM;
+	*p++ = size;
+	for (int i=0; i<size; i++){
+		TELEMETRY_SAMPLE* sample = &telemetry_queue[(telemetry_oldest + first + i) % TELEMETRY_QUEUE_SIZE];
+		p = telemetry_put_word(p, (millis() - sample->time) / 1000);
+		p = telemetry_put_word(p, sample->temp);
+		p = telemetry_put_word(p, sample->press);
+		*p++ = telemetry_status_code(sample->status);
+	}
+	return p - frame;
+}
+
+uint8_t telemetry_encode(uint8_t* frame){
+	// payload encoder of the framed ESP link, every call is a new
+	// report (the link resends a lost frame on its own)
+	telemetry_urgent = false;
+	uint8_t size;
+	uint8_t first = telemetry_start_batch(&size);
+	return telemetry_encode_batch(frame, first, size);
+}
+
+void telemetry_write_binary(uint8_t first, uint8_t size){
+	uint8_t frame[TELEMETRY_FRAME_SIZE];
+	uint8_t length = telemetry_encode_batch(frame, first, size);
+	for (int i=0; i<length; i++) usart_transmit(frame[i]);
+}
+
+void telemetry_write(){
+	// payload writer for the ESP client without the framed link, in the
+	// format the ESP agreed to
+	// there is one report at a time here and a failed try calls the
+	// writer again for the same report: while it is still open its
+	// readings are written again instead of starting the next batch
+	telemetry_urgent = false;
+	uint8_t first = 0;
+	uint8_t size;
+	if (telemetry_batch_count > 0) size = telemetry_batches[0];
+	else first = telemetry_start_batch(&size);
+
+	if (esp_binary) telemetry_write_binary(first, size);
+	else telemetry_write_batch(first, size);
+}
+
+void telemetry_report_done(bool sent){
+	// reports finish in the order they were sent
+	if (telemetry_batch_count == 0) return;
+
+	if (sent){
+		// only a report that got through leaves the queue
+		uint8_t size = telemetry_batches[0];
+		telemetry_oldest = (telemetry_oldest + size) % TELEMETRY_QUEUE_SIZE;
+		telemetry_count -= size;
+		telemetry_in_flight -= size;
+		telemetry_batch_count--;
+		for (int i=0; i<telemetry_batch_count; i++) telemetry_batches[i] = telemetry_batches[i + 1];
+	}
+	else{
+		// a lost report takes the ones sent after it with it,
+		// all of their readings are sent again
+		telemetry_in_flight = 0;
+		telemetry_batch_count = 0;
+	}
+}
+
+#endif /*TELEMETRY*/
\ No newline at end of file
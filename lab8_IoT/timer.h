@@ -0,0 +1,42 @@
+#ifndef _TIMER_
+#define _TIMER_
+
+#include "utils.h"
+#include <util/atomic.h>
+
+// 1ms system tick on Timer0, used for deadlines and periods
+// (adc_trigger_init refuses Timer0 while the tick runs)
+
+// Timer0 CTC at clk/64 = 250KHz, 250 counts = 1ms
+#define TIMER_TOP ((F_CPU/64/1000)-1)
+
+volatile uint32_t timer_ms = 0;
+
+ISR(TIMER0_COMPA_vect){
+	timer_ms++;
+}
+
+void timer_init(){
+	TCCR0A = (1<<WGM01);
+	TCNT0 = 0;
+	OCR0A = TIMER_TOP;
+	TIMSK0 = (1<<OCIE0A);
+	TCCR0B = (1<<CS01)|(1<<CS00);
+	sei();
+}
+
+uint32_t millis(){
+	// 4 byte value, read it with the tick interrupt off
+	uint32_t ms;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		ms = timer_ms;
+	}
+	return ms;
+}
+
+bool timer_expired(uint32_t deadline){
+	// signed difference keeps working when the counter wraps (49 days)
+	return (int32_t)(millis() - deadline) >= 0;
+}
+
+#endif /*TIMER*/
\ No newline at end of file
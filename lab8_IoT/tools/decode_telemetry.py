@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Decode binary telemetry frames back into the lab8 json payload.
+
+The firmware sends (telemetry.h, schema 1):
+    0x02, length, schema, team, count,
+    count x (age s: u16, temperature x100: s16, pressure x100: u16, status: u8)
+little endian. Every frame found in the input is printed as the json
+array the firmware would have sent as ESP:payload, one per line.
+
+usage: decode_telemetry.py [file]      (binary data, stdin by default)
+       decode_telemetry.py --hex 02 0c 01 0e 01 ...
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+FRAME_START = 0x02
+SCHEMA = 1
+STATUSES = ['OK', 'NURSE CALL', 'CHECK PRESSURE', 'CHECK TEMP']
+READING = struct.Struct('<HhHB')
+
+
+def fixed(centi):
+    # hundredths with two decimals, like usart_print_fixed
+    sign = '-' if centi < 0 else ''
+    centi = abs(centi)
+    return '%s%d.%02d' % (sign, centi // 100, centi % 100)
+
+
+def decode_frame(body):
+    schema, team, count = body[0], body[1], body[2]
+    if schema != SCHEMA:
+        raise ValueError('unknown schema %d' % schema)
+    if len(body) != 3 + READING.size * count:
+        raise ValueError('length does not match %d readings' % count)
+
+    fields = [{'name': 'team', 'value': str(team)}]
+    for i in range(count):
+        age, temp, press, status = READING.unpack_from(body, 3 + READING.size * i)
+        if count > 1:
+            fields.append({'name': 'age', 'value': str(age)})
+        fields.append({'name': 'temperature', 'value': fixed(temp)})
+        fields.append({'name': 'pressure', 'value': fixed(press)})
+        name = STATUSES[status] if status < len(STATUSES) else 'UNKNOWN'
+        fields.append({'name': 'status', 'value': name})
+    return fields
+
+
+def frames(data):
+    # skips anything between frames, e.g. text commands
+    i = 0
+    while i + 2 <= len(data):
+        if data[i] != FRAME_START:
+            i += 1
+            continue
+        length = data[i + 1]
+        body = data[i + 2:i + 2 + length]
+        if len(body) < length:
+            break
+        yield body
+        i += 2 + length
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('file', nargs='?')
+    parser.add_argument('--hex', nargs='+', help='frame bytes in hex')
+    args = parser.parse_args()
+
+    if args.hex:
+        data = bytes.fromhex(''.join(args.hex))
+    elif args.file:
+        with open(args.file, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    for body in frames(data):
+        # same spacing as the firmware's json
+        print(json.dumps(decode_frame(body), separators=(',', ':')))
+
+
+if __name__ == '__main__':
+    main()
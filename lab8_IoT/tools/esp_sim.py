@@ -0,0 +1,455 @@
+#!/usr/bin/env python3
+"""Stand-in for the lab8 ESP8266 on a serial pty.
+
+Answers the firmware's ESP commands the way the lab ESP does, so the
+lab8 protocol can be run and timed without the board or the lab server,
+e.g. against the firmware running in simavr:
+
+    simavr -m atmega328pb -f 16000000 main.elf   (with the uart_pty part,
+                                                 USART0 shows up as
+                                                 /tmp/simavr-uart0)
+    esp_sim.py /tmp/simavr-uart0 --latency 50 --fail-rate 0.1
+
+With --pty it opens a fresh pty pair instead and prints the path to
+hand to the simulator.
+
+Commands (one per line, "ESP:" prefix):
+    baud:<rate>       Success, then switches (see below)
+    connect           Success
+    url:"<url>"       Success
+    format:binary     Success, unless --json-only
+    framing:on        Success, unless --no-framing
+    payload:[...]     Success if it is valid json
+    transmit          --transmit-reply, "200 OK" by default
+Binary telemetry frames (0x02, length, ...) are answered like payload.
+
+Speed switch (esp.h): "baud:<rate>" is acked at the old speed, then the
+ESP switches and waits --revert-ms for the same command at the new speed.
+Without that confirmation, or on anything it can't read at the new speed,
+it goes back to 9600. The simulator follows the firmware's speed from the
+answers it let through, so bytes sent while the two differ are garbled
+(dropped and logged) and a lost ack or confirmation shows what the
+firmware does about it. --fast-broken makes the fast speed unusable.
+On a real serial port the port speed is switched too.
+
+Framed link (esp_link.h): frames are run in sequence order, a frame after
+a gap waits for the missing ones, which are asked for again with a NACK,
+and a frame seen twice gets its first answer again without running it.
+Every answer is a frame too, so --drop-rate and --corrupt-rate exercise
+the firmware's retransmits.
+"""
+
+import argparse
+import heapq
+import json
+import os
+import pty
+import random
+import select
+import sys
+import termios
+import time
+import tty
+
+from decode_telemetry import decode_frame, FRAME_START
+
+LINK_SYNC = 0x16
+LINK_ACK = b'A'
+LINK_NACK = b'N'
+LINK_WINDOW = 4
+
+SLOW_BAUD = 9600
+SPEEDS = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+          57600: termios.B57600, 115200: termios.B115200}
+
+
+def crc_ccitt(data, crc=0xFFFF):
+    # avr-libc _crc_ccitt_update, one byte at a time
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc
+
+
+def link_frame(seq, data):
+    header = bytes([seq, len(data)]) + data
+    crc = crc_ccitt(header)
+    return bytes([LINK_SYNC]) + header + bytes([crc & 0xFF, crc >> 8])
+
+
+class Stats:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.bytes_in = 0
+        self.bytes_out = 0
+        self.commands = {}
+        self.reports = 0
+        self.payload_bytes = 0
+
+    def count(self, command, size):
+        self.commands[command] = self.commands.get(command, 0) + 1
+        if command in ('payload', 'binary'):
+            self.payload_bytes += size
+
+    def line(self):
+        elapsed = max(time.monotonic() - self.start, 1e-6)
+        payloads = self.commands.get('payload', 0) + self.commands.get('binary', 0)
+        average = self.payload_bytes / payloads if payloads else 0
+        return ('%.1fs in %d B (%.0f B/s) out %d B, %d reports (%.2f/s), '
+                'avg payload %.0f B, %s'
+                % (elapsed, self.bytes_in, self.bytes_in / elapsed,
+                   self.bytes_out, self.reports, self.reports / elapsed,
+                   average, ' '.join('%s=%d' % kv for kv in sorted(self.commands.items()))))
+
+
+class Esp:
+    def __init__(self, fd, args, log):
+        self.fd = fd
+        self.args = args
+        self.log = log
+        self.stats = Stats()
+        self.buffer = bytearray()
+        self.pending = []       # (due time, order, bytes, log text, after) heap
+        self.order = 0
+        self.last_due = 0
+        self.baud = SLOW_BAUD   # our speed
+        self.peer = SLOW_BAUD   # the firmware's, as far as our answers tell
+        self.revert_at = None   # switched, waiting for the confirmation
+        self.after = None       # called once the current answer went out
+        self.link_reset()
+
+    def link_reset(self):
+        self.expected = 0       # next frame to run
+        self.waiting = {}       # frames received after a gap
+        self.answers = {}       # answers already given, by frame number
+
+    def queue(self, data, text, after=None):
+        # answers keep their order, each one at least --latency after its command
+        # data is None for an answer that gets lost on the way
+        delay = self.args.latency + random.uniform(0, self.args.jitter)
+        due = max(time.monotonic() + delay / 1000.0, self.last_due)
+        self.last_due = due
+        self.order += 1
+        heapq.heappush(self.pending, (due, self.order, data, text, after))
+
+    def garbled(self):
+        # the two ends can't read each other
+        return self.baud != self.peer or (self.args.fast_broken and self.baud != SLOW_BAUD)
+
+    def switch(self, baud, why):
+        self.log('   ESP at %d (%s)' % (baud, why))
+        self.stats.count('switch', 0)
+        self.baud = baud
+        if baud == SLOW_BAUD:
+            self.revert_at = None
+        try:
+            attrs = termios.tcgetattr(self.fd)
+            attrs[4] = attrs[5] = SPEEDS[baud]
+            termios.tcsetattr(self.fd, termios.TCSADRAIN, attrs)
+        except (termios.error, KeyError):
+            pass
+
+    def tick(self):
+        if self.revert_at is not None and time.monotonic() >= self.revert_at:
+            self.switch(SLOW_BAUD, 'no confirmation')
+
+    def dropped(self):
+        # an answer that never arrives, the firmware has to time out
+        if random.random() < self.args.drop_rate:
+            self.log('   (dropped)')
+            return True
+        return False
+
+    def answer(self, text):
+        after, self.after = self.after, None
+        if text is None:
+            return
+        data = (text + self.args.line_end).encode('ascii')
+        if self.dropped():
+            if after is None:
+                return
+            data = None
+        self.queue(data, text, after)
+
+    def link_answer(self, seq, body, text):
+        if self.dropped():
+            return
+        data = link_frame(seq, body)
+        if random.random() < self.args.corrupt_rate:
+            data = data[:-1] + bytes([data[-1] ^ 0x5A])
+            text += ' (corrupted)'
+        self.queue(data, '[%d] %s' % (seq, text))
+
+    def outcome(self, text):
+        # Success may turn into Fail on purpose
+        if text == 'Success' and random.random() < self.args.fail_rate:
+            return 'Fail'
+        return text
+
+    def command(self, line):
+        self.log('<- %s' % (line if len(line) <= 80 else line[:77] + '...'))
+        if not line.startswith('ESP:'):
+            return None
+        body = line[4:]
+        name = body.split(':', 1)[0]
+        self.stats.count(name, len(line) + 1)
+
+        if name == 'payload':
+            try:
+                json.loads(body[len('payload:'):])
+                return self.outcome('Success')
+            except ValueError:
+                return 'Fail'
+        elif name == 'transmit':
+            self.stats.reports += 1
+            return self.args.transmit_reply
+        elif name == 'format':
+            return 'Fail' if self.args.json_only else self.outcome('Success')
+        elif name == 'framing':
+            if self.args.no_framing:
+                return 'Fail'
+            self.link_reset()
+            return self.outcome('Success')
+        elif name == 'baud':
+            return self.baud_command(body[len('baud:'):])
+        elif name in ('connect', 'url'):
+            return 'Fail' if name in self.args.refuse else self.outcome('Success')
+        return 'Fail'
+
+    def baud_command(self, value):
+        try:
+            rate = int(value)
+        except ValueError:
+            return 'Fail'
+        if 'baud' in self.args.refuse or rate not in SPEEDS or rate > self.args.max_baud:
+            return 'Fail'
+
+        if self.baud == SLOW_BAUD:
+            # ack at the old speed, then switch whether or not the ack got through
+            def switched(delivered):
+                self.switch(rate, 'asked')
+                self.revert_at = time.monotonic() + self.args.revert_ms / 1000.0
+                if delivered:
+                    self.peer = rate
+            self.after = switched
+            return 'Success'
+
+        # the confirmation at the new speed
+        text = self.outcome('Success')
+        def confirmed(delivered):
+            if text == 'Success':
+                self.revert_at = None
+                self.log('   confirmed')
+            else:
+                self.switch(SLOW_BAUD, 'refused')
+            if not delivered or text != 'Success':
+                # the firmware gives up on the fast speed
+                self.peer = SLOW_BAUD
+        self.after = confirmed
+        return text
+
+    def frame(self, body):
+        self.stats.count('binary', len(body) + 2)
+        try:
+            fields = decode_frame(bytes(body))
+            self.log('<- [binary %d B] %s' % (len(body) + 2,
+                     json.dumps(fields, separators=(',', ':'))))
+            return self.outcome('Success')
+        except (ValueError, IndexError) as error:
+            self.log('<- [binary %d B] bad frame: %s' % (len(body) + 2, error))
+            return 'Fail'
+
+    def run(self, data):
+        # a command as it is sent without the framed link, less the newline
+        if data and data[0] == FRAME_START:
+            return self.frame(data[2:2 + data[1]])
+        return self.command(data.decode('ascii', 'replace'))
+
+    def link_receive(self, seq, data):
+        self.stats.count('frame', 0)
+        ahead = (seq - self.expected) & 0xFF
+        if ahead >= 0x80:
+            # seen before, its answer got lost
+            self.stats.count('repeat', 0)
+            if seq in self.answers:
+                self.link_answer(seq, LINK_ACK + self.answers[seq].encode('ascii'),
+                                 self.answers[seq])
+            return
+        if ahead >= LINK_WINDOW:
+            return
+
+        if ahead > 0:
+            # the ones before it went missing, ask for them again
+            for missing in range(self.expected, self.expected + ahead):
+                missing &= 0xFF
+                if missing not in self.waiting:
+                    self.stats.count('nack', 0)
+                    self.link_answer(missing, LINK_NACK, 'NACK')
+            self.waiting[seq] = data
+            return
+
+        self.waiting[seq] = data
+        while self.expected in self.waiting:
+            text = self.run(self.waiting.pop(self.expected)) or 'Fail'
+            self.answers[self.expected] = text
+            self.answers.pop((self.expected - LINK_WINDOW) & 0xFF, None)
+            self.link_answer(self.expected, LINK_ACK + text.encode('ascii'), text)
+            self.expected = (self.expected + 1) & 0xFF
+
+    def receive(self, data):
+        self.stats.bytes_in += len(data)
+        if self.garbled():
+            self.log('<- (%d B garbled, ESP at %d, firmware at %d)' % (len(data), self.baud, self.peer))
+            self.stats.count('garbled', 0)
+            self.buffer.clear()
+            if self.revert_at is not None:
+                # the confirmation can't be read, the firmware will give up on it
+                self.peer = SLOW_BAUD
+            if self.baud != SLOW_BAUD:
+                self.switch(SLOW_BAUD, 'garbage')
+            return
+        self.buffer += data
+        while self.buffer:
+            if self.buffer[0] == LINK_SYNC:
+                if len(self.buffer) < 3 or len(self.buffer) < 5 + self.buffer[2]:
+                    return
+                seq, length = self.buffer[1], self.buffer[2]
+                frame = bytes(self.buffer[:5 + length])
+                del self.buffer[:5 + length]
+                crc = frame[-2] | frame[-1] << 8
+                if crc_ccitt(frame[1:-2]) != crc:
+                    self.log('<- [%d] bad crc' % seq)
+                    self.stats.count('nack', 0)
+                    self.link_answer(seq, LINK_NACK, 'NACK')
+                    continue
+                self.link_receive(seq, frame[3:-2])
+                continue
+            if self.buffer[0] == FRAME_START:
+                if len(self.buffer) < 2 or len(self.buffer) < 2 + self.buffer[1]:
+                    return
+                length = self.buffer[1]
+                self.answer(self.frame(self.buffer[2:2 + length]))
+                del self.buffer[:2 + length]
+                continue
+            end = self.buffer.find(b'\n')
+            if end < 0:
+                return
+            line = self.buffer[:end].decode('ascii', 'replace').rstrip('\r')
+            del self.buffer[:end + 1]
+            if line:
+                self.answer(self.command(line))
+
+    def send_due(self):
+        now = time.monotonic()
+        while self.pending and self.pending[0][0] <= now:
+            _, _, data, text, after = heapq.heappop(self.pending)
+            if data is not None and self.garbled():
+                self.log('-> %s (garbled, ESP at %d, firmware at %d)' % (text, self.baud, self.peer))
+                data = None
+            if data is not None:
+                os.write(self.fd, data)
+                self.stats.bytes_out += len(data)
+                self.log('-> %s' % text)
+            if after:
+                after(data is not None)
+
+    def timeout(self):
+        # how long select may sleep before the next answer is due
+        due = [self.pending[0][0]] if self.pending else []
+        if self.revert_at is not None:
+            due.append(self.revert_at)
+        if not due:
+            return 0.5
+        return max(0.0, min(due) - time.monotonic())
+
+
+def open_port(args):
+    if args.pty:
+        master, slave = pty.openpty()
+        tty.setraw(slave)
+        print('ESP pty: %s' % os.ttyname(slave), file=sys.stderr)
+        return master
+    fd = os.open(args.device, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    attrs[4] = attrs[5] = termios.B9600     # ignored by a pty
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.splitlines()[0],
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog='\n'.join(__doc__.splitlines()[1:]))
+    parser.add_argument('device', nargs='?', default='/tmp/simavr-uart0',
+                        help='tty of the firmware USART0')
+    parser.add_argument('--pty', action='store_true',
+                        help='create a pty pair and print its path')
+    parser.add_argument('--latency', type=float, default=20,
+                        help='answer delay in ms')
+    parser.add_argument('--jitter', type=float, default=0,
+                        help='extra random delay in ms, up to this much')
+    parser.add_argument('--fail-rate', type=float, default=0,
+                        help='chance that a Success turns into Fail')
+    parser.add_argument('--drop-rate', type=float, default=0,
+                        help='chance that an answer is never sent')
+    parser.add_argument('--corrupt-rate', type=float, default=0,
+                        help='chance that a framed answer has a bad crc')
+    parser.add_argument('--refuse', nargs='*', default=[],
+                        choices=['baud', 'connect', 'url'],
+                        help='commands that always fail')
+    parser.add_argument('--max-baud', type=int, default=115200,
+                        help='refuse faster speeds')
+    parser.add_argument('--revert-ms', type=float, default=1000,
+                        help='wait for the speed confirmation, ESP_BAUD_REVERT_MS')
+    parser.add_argument('--fast-broken', action='store_true',
+                        help='nothing gets through above 9600')
+    parser.add_argument('--json-only', action='store_true',
+                        help='refuse format:binary')
+    parser.add_argument('--no-framing', action='store_true',
+                        help='refuse framing:on')
+    parser.add_argument('--transmit-reply', default='200 OK')
+    parser.add_argument('--line-end', default='\r\n',
+                        type=lambda s: s.encode().decode('unicode_escape'))
+    parser.add_argument('--stats', type=float, default=10,
+                        help='seconds between throughput lines, 0 for none')
+    parser.add_argument('--quiet', action='store_true',
+                        help='log only the throughput lines')
+    parser.add_argument('--seed', type=int)
+    args = parser.parse_args()
+
+    random.seed(args.seed)
+    fd = open_port(args)
+
+    def log(text):
+        if not args.quiet:
+            print('%9.3f %s' % (time.monotonic() - esp.stats.start, text))
+
+    esp = Esp(fd, args, log)
+    next_stats = time.monotonic() + args.stats
+    try:
+        while True:
+            ready, _, _ = select.select([fd], [], [], min(esp.timeout(), 0.5))
+            if ready:
+                try:
+                    data = os.read(fd, 256)
+                except OSError:
+                    data = b''
+                if not data:
+                    # the other end of the pty isn't open yet / went away
+                    time.sleep(0.1)
+                else:
+                    esp.receive(data)
+            esp.send_due()
+            esp.tick()
+            if args.stats and time.monotonic() >= next_stats:
+                print('stats: ' + esp.stats.line())
+                next_stats += args.stats
+    except KeyboardInterrupt:
+        print('\nstats: ' + esp.stats.line())
+
+
+if __name__ == '__main__':
+    main()
@@ -2,15 +2,41 @@
 #define _USART_
 
 #include "utils.h"
-#include "lcd.h"
+#include "timer.h"
+#include <stdlib.h>
 
 #define UBRR 103
 
+// largest baud rate error accepted by usart_set_baud, in tenths of a percent
+// (115200 is 2.1% off at 16MHz, the ESP's own clock is accurate)
+#define USART_MAX_ERROR 25
+
+// ring buffer sizes, must be powers of two
+#define USART_TX_SIZE 64
+#define USART_RX_SIZE 64
+
+// head is written by the producer, tail by the consumer,
+// so each side only reads what the other one changes
+volatile uint8_t usart_tx_buffer[USART_TX_SIZE];
+volatile uint8_t usart_tx_head = 0;
+volatile uint8_t usart_tx_tail = 0;
+volatile uint8_t usart_rx_buffer[USART_RX_SIZE];
+volatile uint8_t usart_rx_head = 0;
+volatile uint8_t usart_rx_tail = 0;
+// something was queued since usart_init, TXC0 is only ever set
+// once a byte has been shifted out
+bool usart_tx_used = false;
+
 void usart_init(unsigned int ubrr){
 	UCSR0A=0;
 	
-	// enable receiving and transmiting data
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	usart_tx_head = usart_tx_tail = 0;
+	usart_rx_head = usart_rx_tail = 0;
+	usart_tx_used = false;
+	
+	// enable receiving and transmiting data, interrupt on every received byte
+	// (the data register empty interrupt is turned on when there is something to send)
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 	
 	// set BAUD rate
 	UBRR0H = (unsigned char)(ubrr >> 8);
@@ -19,23 +45,200 @@ void usart_init(unsigned int ubrr){
 	// set charachter size to 8 bits and asynchronous mode
 	UCSR0C = (3 << UCSZ10);
 	
+	sei();
 	return;
 }
 
-void usart_transmit(uint8_t data){
-	// make transmit register ready to receive data
-	while(!(UCSR0A & (1 << UDRE0)));
+ISR(USART0_UDRE_vect){
+	if (usart_tx_head == usart_tx_tail){
+		// nothing left to send
+		UCSR0B &= ~(1 << UDRIE0);
+		return;
+	}
 	
-	// write the data to the register
-	UDR0 = data;
+	// clear TXC0 so usart_flush can tell when this byte is out
+	// (the error flags must be written as 0, keep only U2X0)
+	UCSR0A = (UCSR0A & (1 << U2X0)) | (1 << TXC0);
+	UDR0 = usart_tx_buffer[usart_tx_tail];
+	usart_tx_tail = (usart_tx_tail + 1) & (USART_TX_SIZE - 1);
 }
 
-uint8_t usart_receive(){
-	// set RXC1 to let the device know that there are data ready to be read
-	while(!(UCSR0A & (1 << RXC0)));
+ISR(USART0_RX_vect){
+	uint8_t data = UDR0;
+	uint8_t next = (usart_rx_head + 1) & (USART_RX_SIZE - 1);
+	
+	// buffer full, the byte is dropped
+	if (next == usart_rx_tail) return;
+	
+	usart_rx_buffer[usart_rx_head] = data;
+	usart_rx_head = next;
+}
+
+uint8_t usart_tx_free(){
+	// bytes that can be queued without waiting
+	return (usart_tx_tail - usart_tx_head - 1) & (USART_TX_SIZE - 1);
+}
+
+uint8_t usart_available(){
+	// bytes received and not read yet
+	return (usart_rx_head - usart_rx_tail) & (USART_RX_SIZE - 1);
+}
+
+uint8_t usart_write(const uint8_t* data, uint8_t length){
+	// queues as much of data as fits and returns how much that was
+	uint8_t count = 0;
+	while (count < length){
+		uint8_t next = (usart_tx_head + 1) & (USART_TX_SIZE - 1);
+		if (next == usart_tx_tail) break;
+		usart_tx_buffer[usart_tx_head] = data[count++];
+		usart_tx_head = next;
+	}
+	
+	// wake the transmitter
+	if (count > 0){
+		usart_tx_used = true;
+		UCSR0B |= (1 << UDRIE0);
+	}
+	return count;
+}
+
+uint8_t usart_read(uint8_t* data, uint8_t length){
+	// copies up to length received bytes and returns how many
+	uint8_t count = 0;
+	while (count < length && usart_rx_tail != usart_rx_head){
+		data[count++] = usart_rx_buffer[usart_rx_tail];
+		usart_rx_tail = (usart_rx_tail + 1) & (USART_RX_SIZE - 1);
+	}
+	return count;
+}
+
+void usart_rx_discard(){
+	// throws away everything received and not read yet
+	usart_rx_tail = usart_rx_head;
+}
+
+void usart_flush(){
+	// wait until everything queued has been shifted out,
+	// with nothing ever sent there is nothing to wait for
+	if (!usart_tx_used) return;
+	while(usart_tx_head != usart_tx_tail);
+	while(UCSR0B & (1 << UDRIE0));
+	while(!(UCSR0A & (1 << TXC0)));
+}
+
+int16_t usart_baud_error(uint32_t baud, uint16_t ubrr, uint8_t samples){
+	// (actual / requested - 1) in tenths of a percent
+	// samples is 16 in normal and 8 in double speed mode
+	int32_t actual = F_CPU / ((uint32_t)samples * (ubrr + 1));
+	return (actual - (int32_t)baud) * 1000 / (int32_t)baud;
+}
+
+bool usart_baud_setting(uint32_t baud, uint16_t* ubrr, bool* double_speed){
+	// UBRR rounded to the nearest value for both speeds,
+	// U2X0 halves the samples per bit and often gets closer
+	// false if neither is within USART_MAX_ERROR
+	uint16_t ubrr_normal = (F_CPU + 8 * baud) / (16 * baud) - 1;
+	uint16_t ubrr_double = (F_CPU + 4 * baud) / (8 * baud) - 1;
+	int16_t error_normal = usart_baud_error(baud, ubrr_normal, 16);
+	int16_t error_double = usart_baud_error(baud, ubrr_double, 8);
+	
+	*double_speed = abs(error_double) < abs(error_normal);
+	*ubrr = *double_speed ? ubrr_double : ubrr_normal;
+	int16_t error = *double_speed ? error_double : error_normal;
+	return abs(error) <= USART_MAX_ERROR;
+}
+
+bool usart_baud_supported(uint32_t baud){
+	uint16_t ubrr;
+	bool double_speed;
+	return usart_baud_setting(baud, &ubrr, &double_speed);
+}
+
+bool usart_set_baud(uint32_t baud){
+	uint16_t ubrr;
+	bool double_speed;
+	if (!usart_baud_setting(baud, &ubrr, &double_speed)) return 0;
+	
+	// don't change speed in the middle of a byte
+	usart_flush();
+	UCSR0A = double_speed ? (1 << U2X0) : 0;
+	UBRR0H = (unsigned char)(ubrr >> 8);
+	UBRR0L = (unsigned char)ubrr;
 	
-	// return the received data
-	return UDR0;
+	return 1;
+}
+
+void usart_transmit(uint8_t data){
+	// wait only if the buffer is full
+	while(usart_write(&data, 1) == 0);
+}
+
+uint8_t usart_receive(){
+	// wait until a byte has arrived
+	uint8_t data;
+	while(usart_read(&data, 1) == 0);
+	return data;
+}
+
+// ---------------- line assembler ----------------
+// collects received bytes into a line without ever waiting:
+// "\r", "\n" and "\r\n" all end a line and are not stored, empty
+// lines are skipped, and a line longer than the buffer is cut short
+// (the rest of it is read and thrown away) instead of overrunning it
+
+typedef enum {
+	LINE_PENDING = 0,		// no complete line yet
+	LINE_COMPLETE,			// a line is in the buffer
+	LINE_OVERFLOW,			// a line ended but didn't fit, the start of it is in the buffer
+	LINE_TIMEOUT			// the deadline passed first
+} LINE_RESULT;
+
+typedef struct {
+	char* buffer;
+	uint8_t size;			// including the terminating '\0'
+	uint8_t length;
+	bool overflow;
+} LINE_ASSEMBLER;
+
+void line_init(LINE_ASSEMBLER* line, char* buffer, uint8_t size){
+	line->buffer = buffer;
+	line->size = size;
+	line->length = 0;
+	line->overflow = false;
+	buffer[0] = '\0';
+}
+
+LINE_RESULT line_poll(LINE_ASSEMBLER* line){
+	// takes what the receive buffer holds, returns as soon as a line ends
+	uint8_t c;
+	while(usart_read(&c, 1)){
+		if (c == '\r' || c == '\n'){
+			// the second half of "\r\n" or an empty line
+			if (line->length == 0 && !line->overflow) continue;
+			
+			line->buffer[line->length] = '\0';
+			LINE_RESULT result = line->overflow ? LINE_OVERFLOW : LINE_COMPLETE;
+			line->length = 0;
+			line->overflow = false;
+			return result;
+		}
+		
+		if (line->length < line->size - 1) line->buffer[line->length++] = c;
+		else line->overflow = true;
+	}
+	return LINE_PENDING;
+}
+
+LINE_RESULT line_receive(LINE_ASSEMBLER* line, uint32_t deadline){
+	// waits for a line until the deadline (a millis() value)
+	while(1){
+		LINE_RESULT result = line_poll(line);
+		if (result != LINE_PENDING) return result;
+		if (timer_expired(deadline)){
+			line->buffer[line->length] = '\0';
+			return LINE_TIMEOUT;
+		}
+	}
 }
 
 void esp_send_command(const char* string){
@@ -51,40 +254,12 @@ void esp_send_command(const char* string){
 	usart_transmit('\n');
 }
 
-void esp_receive_answer(char* esp_answer){
-	esp_answer[0] = '\0';	// reset the array
-	int index = 0;
-	char c;
-	
-	while(1){
-		c = usart_receive();
-		if (c == '\n') break;
-		esp_answer[index++] = c;
-		if (index >= 64) break;
-	}
-	
-	esp_answer[index] = '\0';
-}
-
-void esp_print_response(char cmd_count, char* esp_answer){
-	lcd_data(cmd_count);
-	lcd_data('.');
-	
-	if(strstr(esp_answer, "Success") != NULL){
-		lcd_data('S');
-		lcd_data('u');
-		lcd_data('c');
-		lcd_data('c');
-		lcd_data('e');
-		lcd_data('s');
-		lcd_data('s');
-	}
-	else{
-		lcd_data('F');
-		lcd_data('a');
-		lcd_data('i');
-		lcd_data('l');
-	}
+LINE_RESULT esp_receive_answer(char* esp_answer, uint8_t size, uint16_t timeout_ms){
+	// waits at most timeout_ms for the ESP's answer line,
+	// esp_answer always ends up '\0' terminated within size bytes
+	LINE_ASSEMBLER line;
+	line_init(&line, esp_answer, size);
+	return line_receive(&line, millis() + timeout_ms);
 }
 
 #endif /*USART*/
\ No newline at end of file